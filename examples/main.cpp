@@ -2,6 +2,7 @@
 #include <iomanip>
 #include <chrono>
 #include <thread>
+#include <vector>
 
 #include <chatter/chatter.h>
 
@@ -33,6 +34,7 @@ int main(int argc, char* argv[])
 
     int i = 0;
     chatter::HostAddress host_address;
+    std::vector<chatter::Event::ptr> events;
 
     while (1) {
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
@@ -51,8 +53,10 @@ int main(int argc, char* argv[])
             i = 0;
         }
 
-        chatter::Event::ptr e;
-        while (e = host.get_event()) {
+        events.clear();
+        host.get_events(events, 256);
+
+        for (auto& e : events) {
             std::cout << "Received event: " << e->to_string() << std::endl;
             switch (e->type) {
             case chatter::EventType::PEER_CONNECTED:
@@ -4,6 +4,7 @@
 #include "chatter/host.h"
 #include "chatter/hostaddress.h"
 #include "chatter/event.h"
+#include "chatter/dispatcher.h"
 #include "chatter/packet.h"
 #include "chatter/packet_listener.h"
 
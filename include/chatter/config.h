@@ -2,34 +2,111 @@
 #define _CH_CONFIG_H_
 
 #include <climits>
+#include <cstddef>
+#include <cstdint>
 
 namespace chatter {
 
 const int kMaxUDPPayloadSize = 65507;
 
+/* All protocol times are in microseconds */
+
 /* Timeout for connection attempts (connecting peers) */
-const int kConnectTimeOut = 5 * 1000; /* 5 seconds */
+const int kConnectTimeOut = 5 * 1000 * 1000; /* 5 seconds */
 
 /* Timeout for connected peers */
-const int kPeerTimeOut = 20 * 1000; /* 20 seconds */
+const int kPeerTimeOut = 20 * 1000 * 1000; /* 20 seconds */
 
 /* If no data received after this period of time, send a ping on this interval */
-const int kPingInterval = 1 * 1000;
+const int kPingInterval = 1 * 1000 * 1000;
+
+/* Ping at least this often regardless, to keep the peer clock offset fresh */
+const int kClockSyncInterval = 5 * 1000 * 1000;
+
+/* Delayed ack - acks for received reliable packets are held back for up to this
+ * long so several can be reported in one PROTO_ACK */
+const int kAckDelay = 5 * 1000;
+
+/* Resolution of the protocol timer wheel */
+const int kTimerTick = 100;
+
+/* Number of sequence numbers per channel the receiver tracks ahead of the
+ * cumulative ack. Must be a power of two. */
+const int kReceiveWindowSize = 256;
 
 /* Back off factor - retransmission interval is multiplied by this for each retransmit */
 const int kRetransmissionBackOffFactor = 2;
 
 /* Retransmission interval limits (back off will not cause interval to exceed this) */
-const int kMinRetransmissionInterval = 10;
-const int kMaxRetransmissionInterval = 3 * 1000; /* 3 seconds */
+const int kMinRetransmissionInterval = 1 * 1000; /* 1 millisecond */
+const int kMaxRetransmissionInterval = 3 * 1000 * 1000; /* 3 seconds */
+
+/* Fast retransmit - an unacked packet is presumed lost once this many later
+ * sequence numbers have been acked (TCP's three duplicate acks), or once a
+ * packet sent more than a quarter RTT after it has been acked (RACK) */
+const int kFastRetransmitThreshold = 3;
+
+/* Path MTU. Each peer starts at kBaseMTU, which any IPv4 or IPv6 path should
+ * carry, and probes upwards as far as kMaxMTU (jumbo frames). */
+const int kBaseMTU = 1280;
+const int kEthernetMTU = 1500;
+const int kMaxMTU = 9000;
+
+/* IPv4 + UDP header overhead - packets are coalesced into datagrams of at most
+ * the peer's MTU - kUDPHeaderSize bytes */
+const int kUDPHeaderSize = 28;
+const int kMaxDatagramSize = kMaxMTU - kUDPHeaderSize;
+
+/* MTU probing (DPLPMTUD, RFC 8899). Probes are padded pings sent with DF set,
+ * binary searching between the confirmed MTU and the largest not yet ruled
+ * out. A size is ruled out after kMtuMaxProbes unanswered probes; the search
+ * stops once the gap is under kMtuProbeMinStep and starts over after
+ * kMtuRaiseInterval in case the path has grown. */
+const int kMtuMaxProbes = 3;
+const int kMtuProbeMinStep = 16;
+const int64_t kMtuRaiseInterval = 600LL * 1000 * 1000; /* 10 minutes */
 
-const int kMTU = 1500; /* TODO(ben): more specific value needed. */
+/* Consecutive timeouts of one packet taken to mean the path MTU has shrunk -
+ * the peer drops back to kBaseMTU and searches again */
+const int kMtuBlackHoleResends = 3;
 
-/* Congestion control */
-const int kCongestionInc = kMTU;
+/* A reliable packet built for a larger MTU than the path now carries is
+ * resent split into PROTO_SPLIT pieces. The receiver reassembles at most
+ * kMaxSplitAssemblies of these per peer, dropping the oldest beyond that. */
+const std::size_t kMaxSplitAssemblies = 4;
+
+/* Largest message that can be sent - anything over a datagram is split into
+ * reliable fragments and reassembled at the receiver */
+const std::size_t kMaxMessageSize = 4 * 1024 * 1024;
+
+/* Bounds on reassembly - a message needing a new assembly beyond either is
+ * refused until earlier ones complete */
+const std::size_t kMaxFragmentAssemblies = 8;                /* Per channel */
+const std::size_t kMaxReassemblyBytes = 2 * kMaxMessageSize; /* Per peer */
+
+/* Maximum number of datagrams moved per recvmmsg / sendmmsg call */
+const std::size_t kSocketBatchSize = 32;
+
+/* Longest the threaded network worker sleeps between checks for shutdown (us) */
+const int kNetWorkerWait = 10 * 1000;
+
+/* Receive slots between the receive and network threads in THREADED mode.
+ * Each holds a whole kMaxDatagramSize datagram - about 2.3MB in all - and
+ * bursts beyond it wait in the socket buffer. Rounded up to a power of two. */
+const std::size_t kRecvRingSize = 256;
+
+/* Maximum number of packets coalesced into one datagram - each is sent
+ * straight from its own storage as one segment of a gather write */
+const std::size_t kMaxDatagramSegments = 64;
+
+/* Congestion control - windows grow in segments of the peer's largest datagram */
 const int kCongestionDecFactor = 2;
-const int kMinCongestionWindow = kMTU * 2;
-const int kMaxCongestionWindow = INT_MAX - kCongestionInc - 1;
+const int kMinCongestionSegments = 2;
+const int kMaxCongestionWindow = INT_MAX - kMaxMTU - 1;
+
+/* Send pacing - bytes a peer may send back to back before pacing spaces them
+ * out, so sends released by a coarse wake-up still go as a small burst */
+const int kPacingQuantum = kBaseMTU * 2;
 
 } // namespace chatter
 
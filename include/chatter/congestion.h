@@ -0,0 +1,141 @@
+#ifndef _CH_CONGESTION_H_
+#define _CH_CONGESTION_H_
+
+#include <cstdint>
+#include <memory>
+
+#include "chatter/config.h"
+
+namespace chatter {
+
+enum class CongestionAlgorithm
+{
+    RENO,           //> Slow start, additive increase, halve on loss (default)
+    CUBIC,          //> Cubic window growth around the last loss point (RFC 8312)
+    DELIVERY_RATE,  //> Window from measured bottleneck bandwidth x min RTT (BBR-like)
+};
+
+/* Decides how many reliable bytes a peer may have in flight. The protocol
+ * calls the hooks from the network thread; all times are microseconds on the
+ * host clock and all sizes are payload bytes.
+ */
+class CongestionController
+{
+public:
+    CongestionController();
+    virtual ~CongestionController() {}
+
+    static std::unique_ptr<CongestionController> create(CongestionAlgorithm algorithm);
+
+    virtual CongestionAlgorithm algorithm() const = 0;
+
+    /* Bytes allowed in flight */
+    virtual uint32_t window() const = 0;
+
+    virtual void reset() = 0;
+
+    /* Bytes in the peer's largest datagram - the unit windows grow and
+     * shrink by. Changes as the path MTU is discovered. */
+    void set_segment_size(uint32_t bytes) { m_segment = bytes; }
+
+    /* A reliable packet of bytes went on the wire (first send or resend) */
+    virtual void on_send(uint64_t now, uint32_t bytes, uint32_t bytes_in_flight) {}
+
+    /* A reliable packet of bytes was acked. rtt is 0 if the packet was resent
+     * and gives no sample. */
+    virtual void on_ack(uint64_t now, uint32_t bytes, uint32_t rtt, uint32_t bytes_in_flight) = 0;
+
+    /* Start of a loss event - called once per event, not per lost packet */
+    virtual void on_loss(uint64_t now, uint32_t bytes_in_flight) = 0;
+
+    /* RTT measured outside of acks (ping / pong) */
+    virtual void on_rtt_sample(uint64_t now, uint32_t rtt) {}
+
+    /* Rate (bytes/s) to spread sends at, given the smoothed RTT. 0 leaves the
+     * peer unpaced. By default the window is spread over a round trip. */
+    virtual uint64_t pacing_rate(uint32_t srtt) const;
+
+protected:
+    static uint64_t window_rate(uint32_t window, uint32_t srtt, double gain);
+
+    /* Keeps a window between kMinCongestionSegments and kMaxCongestionWindow */
+    double clamp_window(double window) const;
+    uint32_t min_window() const { return m_segment * kMinCongestionSegments; }
+
+    uint32_t m_segment;
+};
+
+class RenoController : public CongestionController
+{
+public:
+    RenoController();
+
+    virtual CongestionAlgorithm algorithm() const { return CongestionAlgorithm::RENO; }
+    virtual uint32_t window() const { return m_window; }
+    virtual void reset();
+    virtual void on_ack(uint64_t now, uint32_t bytes, uint32_t rtt, uint32_t bytes_in_flight);
+    virtual void on_loss(uint64_t now, uint32_t bytes_in_flight);
+    virtual uint64_t pacing_rate(uint32_t srtt) const;
+
+private:
+    uint32_t m_window;
+    uint32_t m_ssthresh;        //> Slow start while the window is below this
+    uint32_t m_ca_acked;        //> Bytes acked towards the next congestion avoidance increase
+};
+
+class CubicController : public CongestionController
+{
+public:
+    CubicController();
+
+    virtual CongestionAlgorithm algorithm() const { return CongestionAlgorithm::CUBIC; }
+    virtual uint32_t window() const { return static_cast<uint32_t>(m_window); }
+    virtual void reset();
+    virtual void on_ack(uint64_t now, uint32_t bytes, uint32_t rtt, uint32_t bytes_in_flight);
+    virtual void on_loss(uint64_t now, uint32_t bytes_in_flight);
+    virtual void on_rtt_sample(uint64_t now, uint32_t rtt);
+    virtual uint64_t pacing_rate(uint32_t srtt) const;
+
+private:
+    double m_window;            //> Bytes - fractional so small acks still grow it
+    uint32_t m_ssthresh;
+    double m_w_max;             //> Window (segments) at the last loss
+    double m_k;                 //> Seconds from the epoch start until the curve is back at m_w_max
+    double m_w_est;             //> Reno-friendly window estimate (segments)
+    uint64_t m_epoch_start;     //> Start of the current growth epoch, 0 if none
+    uint32_t m_min_rtt;
+};
+
+class DeliveryRateController : public CongestionController
+{
+public:
+    DeliveryRateController();
+
+    virtual CongestionAlgorithm algorithm() const { return CongestionAlgorithm::DELIVERY_RATE; }
+    virtual uint32_t window() const { return m_window; }
+    virtual void reset();
+    virtual void on_ack(uint64_t now, uint32_t bytes, uint32_t rtt, uint32_t bytes_in_flight);
+    virtual void on_loss(uint64_t now, uint32_t bytes_in_flight);
+    virtual void on_rtt_sample(uint64_t now, uint32_t rtt);
+    virtual uint64_t pacing_rate(uint32_t srtt) const;
+
+private:
+    static const int kBandwidthRounds = 10;
+
+    void update_window();
+
+    uint32_t m_window;
+    bool m_startup;                         //> Still growing exponentially to find the bottleneck
+    int m_full_bw_rounds;                   //> Rounds in startup without 25% bandwidth growth
+    uint64_t m_full_bw;                     //> Bandwidth at the last 25% growth (bytes/s)
+    uint64_t m_bw_samples[kBandwidthRounds]; //> Delivery rate per round (bytes/s), max filtered
+    int m_round;
+    uint64_t m_round_start;                 //> Time the current delivery round began
+    uint64_t m_round_delivered;             //> Bytes acked during the current round
+    uint32_t m_min_rtt;
+    uint64_t m_min_rtt_ts;                  //> When m_min_rtt was measured - expires after 10s
+};
+
+} // namespace chatter
+
+#endif // _CH_CONGESTION_H_
@@ -0,0 +1,51 @@
+#ifndef _CH_DISPATCHER_H_
+#define _CH_DISPATCHER_H_
+
+#include <functional>
+
+#include "chatter/types.h"
+#include "chatter/hostaddress.h"
+#include "chatter/packet.h"
+#include "chatter/event.h"
+
+namespace chatter {
+
+/* Opt-in alternative to polling Host::get_event. Handlers registered here are
+ * called for matching events instead of an Event being queued - anything
+ * without a handler still goes through the event queue.
+ *
+ * Handlers run inline on the network thread unless an executor is set, in
+ * which case each call is handed to the executor (which may run it anywhere).
+ * Register everything before Host::start - the tables are not locked.
+ */
+class Dispatcher
+{
+public:
+    typedef std::function<void(const HostAddress& address)> ConnectionHandler;
+    typedef std::function<void(const HostAddress& address, Packet& packet)> PacketHandler;
+    typedef std::function<void(std::function<void()> task)> Executor;
+
+    /* PEER_CONNECTED, PEER_DISCONNECTED, PEER_TIMED_OUT or PEER_UNABLE_TO_CONNECT */
+    void on_connection(EventType type, ConnectionHandler handler);
+
+    /* PACKET_RECEIVED on the given channel */
+    void on_packet(ProtocolChannelID channel, PacketHandler handler);
+
+    void set_executor(Executor executor);
+
+    /* Called by the network thread. Return false if no handler is registered. */
+    bool dispatch(EventType type, const HostAddress& address);
+    bool dispatch_packet(const HostAddress& address, const Packet::ptr& packet);
+
+private:
+    static const int kConnectionEvents = PEER_UNABLE_TO_CONNECT + 1;
+    static const int kChannels = kReliableUnorderedChannel + 1;
+
+    ConnectionHandler m_connection_handlers[kConnectionEvents];
+    PacketHandler m_packet_handlers[kChannels];
+    Executor m_executor;
+};
+
+} // namespace chatter
+
+#endif // _CH_DISPATCHER_H_
@@ -3,6 +3,7 @@
 
 #include "chatter/hostaddress.h"
 #include "chatter/packet.h"
+#include "chatter/packetpool.h"
 
 namespace chatter {
 
@@ -25,7 +26,7 @@ struct Event
 
     static Event::ptr create(EventType t)
     {
-        Event::ptr e = std::make_shared<Event>();
+        Event::ptr e = std::allocate_shared<Event>(PacketPool<Event>());
         e->type = t;
         return e;
     }
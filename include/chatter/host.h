@@ -4,11 +4,12 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <unordered_map>
 #include <cstdint>
 #include <thread>
+#include <atomic>
 #include <chrono>
 #include <mutex>
-#include <condition_variable>
 
 #include "chatter/platform.h"
 #include "chatter/config.h"
@@ -16,6 +17,9 @@
 #include "chatter/ipaddress.h"
 #include "chatter/protocol.h"
 #include "chatter/event.h"
+#include "chatter/spsc_ring.h"
+#include "chatter/mpsc_queue.h"
+#include "chatter/dispatcher.h"
 
 namespace chatter
 {
@@ -23,11 +27,20 @@ namespace chatter
 struct RecvMsg
 {
     uint32_t timestamp;
-    uint8_t msg[kMTU];
+    uint8_t msg[kMaxDatagramSize];
     std::size_t msg_size;
     HostAddress address;
 };
 
+/* Request made on the application thread, carried out on the network thread */
+struct AppRequest
+{
+    enum Type { CONNECT, SEND, CONGESTION } type;
+    HostAddress address;
+    Packet::ptr packet;
+    CongestionAlgorithm algorithm;
+};
+
 class PacketListener;
 
 class Host
@@ -36,6 +49,13 @@ public:
     Host();
     ~Host();
 
+    /* How the host drives its socket - chosen before start() */
+    enum RunMode {
+        THREADED,   //> Receive thread plus network thread (default)
+        EVENT_LOOP, //> One thread sleeping in epoll on the socket, app requests and the next protocol deadline
+        EXTERNAL,   //> No threads - the application calls service() from its own loop
+    };
+
     enum StartResult {
         START_OK,
         ALREADY_RUNNING,
@@ -43,14 +63,64 @@ public:
         SOCKET_BIND_FAILED
     };
 
+    void set_run_mode(RunMode mode);
+
+    /* Congestion control for peers claimed from now on - set before start() */
+    void set_congestion_control(CongestionAlgorithm algorithm);
+
+    /* Switches a connected peer's congestion control (restarting it) */
+    void set_congestion_control(const HostAddress& address, CongestionAlgorithm algorithm);
     StartResult start(const HostAddress& bind_address, uint16_t max_connections);
+
+    /* EXTERNAL mode. Waits up to timeout_ms (< 0 forever, 0 not at all) for
+     * the socket to become readable, cut short by the next protocol deadline
+     * or requests already queued, then does one pass: reads everything
+     * available, runs due protocol timers and flushes the send queue. Returns
+     * the number of datagrams received. Call from one thread only. A sharded
+     * host services each shard without waiting. */
+    std::size_t service(int timeout_ms = 0);
+
+    /* For registering with an external reactor in EXTERNAL mode - readable
+     * when service() has datagrams to read. CH_SOCKET_NULL for a sharded host. */
+    Socket socket_fd() const { return m_socket; }
+
+    /* When service() next has protocol work to do, on the timestamp_now()
+     * clock. UINT64_MAX if nothing is scheduled. */
+    uint64_t next_deadline();
+
+    /* Sharded mode - opens shard_count SO_REUSEPORT sockets on bind_address,
+     * each with its own workers, protocol state and share of max_connections.
+     * The kernel keeps each peer on one shard. Events from every shard are
+     * delivered through this host (dispatcher and packet listener calls come
+     * from the shard threads, except PACKET_NOT_DELIVERED for a send to an
+     * unknown peer, which send() posts itself). Outgoing connect() is not
+     * supported, as replies may be steered to a different shard. */
+    StartResult start(const HostAddress& bind_address, uint16_t max_connections, int shard_count);
+
+    /* Connection attempts are carried out by the network thread. Returns false
+     * if the host is not running - a failed attempt is reported with a
+     * PEER_UNABLE_TO_CONNECT event. */
     bool connect(const HostAddress& host_address);
     void shutdown();
     bool is_active(); // True if network thread is running.
-    uint64_t timestamp_now();
+    uint64_t timestamp_now(); // Microseconds since start(), read from the steady clock
+
+    /* Events are consumed by a single application thread */
     Event::ptr get_event();
+
+    /* Moves up to max pending events onto the back of events (any container
+     * with push_back) and returns the number moved */
+    template <typename Container>
+    std::size_t get_events(Container& events, std::size_t max = SIZE_MAX);
+
+    /* Sends to an address with no peer, and messages over kMaxMessageSize,
+     * are handed back in a PACKET_NOT_DELIVERED event */
     void send(const HostAddress& address, Packet::ptr packet);
     void register_packet_listener(PacketListener *listener);
+
+    /* Routes events with a registered handler to dispatcher instead of the
+     * event queue. Set before start(), nullptr to go back to polling only. */
+    void set_dispatcher(Dispatcher* dispatcher);
     void build_packet_stats(Packet::ptr packet, PacketStats &packet_s, PeerStats &peer_s);
 
 private:
@@ -58,14 +128,38 @@ private:
 
     Peer* find_available_peer(const HostAddress& address);
     Peer* find_peer_by_address(const HostAddress& address);
+    void release_peer(Peer* peer);
+    void set_shard_peer(const HostAddress& address, Host* shard);
+    Host* find_shard(const HostAddress& address);
     bool create_socket();
     void destroy_socket();
     void net_worker();
     void recv_worker();
+    void loop_worker();
+    int recv_batch();
+    std::size_t drain_socket();
+    void handle_received();
+    void service_network();
+    void wake();
+    void update_clock();
+    uint64_t now() const { return m_now; }
     void receive_message(const RecvMsg& msg);
+    void service_app_requests();
     void queue_outgoing_packet(const Packet::ptr packet, bool immediate = false);
+
+    /* Puts a peer with held user data on the next send pass - called when its
+     * pacing, congestion or receive window may have opened */
+    void mark_send_due(Peer* peer);
+    void service_peer_sends(Peer* peer);
+    bool prepare_packet_send(const Packet::ptr packet);
     void send_packet_internal(const Packet::ptr packet);
-    void queue_event(const Event::ptr event);
+    void batch_packet(const Packet::ptr packet);
+    void send_split(const Packet::ptr packet);
+    void flush_send_batch();
+    void post_event(EventType type, const HostAddress& address, const Packet::ptr& packet = nullptr);
+
+    /* Hands an unsent packet back to the application as PACKET_NOT_DELIVERED */
+    void post_not_delivered(const HostAddress& address, const Packet::ptr& packet);
 
     Socket m_socket = CH_SOCKET_NULL;
     uint16_t m_max_connections = 1;
@@ -75,23 +169,77 @@ private:
     std::unique_ptr<std::thread> m_recv_worker;
 
     std::vector<Peer> m_peers;
+    std::unordered_map<uint64_t, Peer*> m_peer_index; //> Claimed peers by packed address
+    std::vector<Peer*> m_free_peers;                  //> Unclaimed peer slots
 
     Protocol m_protocol;
 
-    std::chrono::high_resolution_clock::time_point m_start_time;
+    std::chrono::steady_clock::time_point m_start_time;
+    uint64_t m_now = 0;     //> Network thread's clock, sampled once per receive batch and service pass
+
+    /* recv_worker receives straight into ring slots and net_worker handles
+     * them in place. m_recv_event only wakes net_worker once it has announced
+     * it is going to sleep on an empty ring, and m_recv_space_event likewise
+     * wakes recv_worker once it is sleeping on a full one. */
+    SpscRing<RecvMsg> m_recv_ring;
+    WakeEvent m_recv_event = CH_WAKE_EVENT_NULL;
+    std::atomic<bool> m_recv_waiting{false};
+    WakeEvent m_recv_space_event = CH_WAKE_EVENT_NULL;
+    std::atomic<bool> m_recv_full{false};
+
+    /* Event loop mode - wakes the loop for application requests. EXTERNAL
+     * mode uses the pending flag to skip waiting in service(). */
+    RunMode m_run_mode = THREADED;
+    CongestionAlgorithm m_congestion_algorithm = CongestionAlgorithm::RENO;
+    WakeEvent m_app_event = CH_WAKE_EVENT_NULL;
+    std::atomic<bool> m_app_wake_pending{false};
+
+    /* Network thread only. Protocol packets go out on the next pass; user
+     * data waits in its peer's queue, and only peers in m_send_due are
+     * visited. */
+    std::vector<Packet::ptr> m_send_queue;
+    std::vector<Peer*> m_send_due;
+    std::vector<Peer*> m_send_due_swap;
+
+    std::vector<AppRequest> m_app_requests;     //> Guarded by m_app_requests_mutex
+    std::vector<AppRequest> m_app_requests_swap;
+    std::mutex m_app_requests_mutex;
+
+    /* Serialized packets waiting to go out in one sendmmsg call (network thread only).
+     * Packets for the same peer are coalesced into one datagram as a list of
+     * segments pointing at each packet's own serialized frame. */
+    Datagram m_send_batch[kSocketBatchSize];
+    Peer* m_send_batch_peers[kSocketBatchSize];
+    DatagramSegment m_send_segments[kSocketBatchSize][kMaxDatagramSegments];
+    std::vector<Packet::ptr> m_send_batch_packets;  //> Keeps segment storage alive until flushed
+    std::size_t m_send_batch_count = 0;
+
+    MpscQueue<Event::ptr> m_event_queue;
 
-    std::vector<RecvMsg> m_recv_queue;
-    std::mutex m_recv_queue_mutex;
-    std::condition_variable m_recv_queue_cv;
+    PacketListener *m_packet_listener = nullptr;
+    Dispatcher* m_dispatcher = nullptr;
+
+    /* Sharded mode. The parent host owns the shards and the event queue; each
+     * shard registers the peers it claims so send() can find the right one. */
+    Host* m_parent = nullptr;
+    std::vector<std::unique_ptr<Host>> m_shards;
+    std::unordered_map<uint64_t, Host*> m_shard_index;  //> Guarded by m_shard_index_mutex
+    std::mutex m_shard_index_mutex;
+};
 
-    std::list<Packet::ptr> m_send_queue;
-    std::mutex m_send_queue_mutex;
+template <typename Container>
+std::size_t Host::get_events(Container& events, std::size_t max /* = SIZE_MAX */)
+{
+    std::size_t count = 0;
+    Event::ptr e;
 
-    std::queue<Event::ptr> m_event_queue;
-    std::mutex m_event_queue_mutex;
+    while (count < max && m_event_queue.pop(e)) {
+        events.push_back(std::move(e));
+        count++;
+    }
 
-    PacketListener *m_packet_listener = nullptr;
-};
+    return count;
+}
 
 } // namespace chatter
 
@@ -20,6 +20,9 @@ public:
     uint32_t address() const;
     uint16_t port() const;
 
+    /* Address and port packed into one value, for use as a lookup key */
+    uint64_t key() const { return (static_cast<uint64_t>(m_address) << 16) | m_port; }
+
     inline bool operator ==(const HostAddress& other)
     {
         return (m_address == other.address() && m_port == other.port());
@@ -0,0 +1,101 @@
+#ifndef _CH_MPSC_QUEUE_H_
+#define _CH_MPSC_QUEUE_H_
+
+#include <atomic>
+#include <utility>
+
+#include "chatter/packetpool.h"
+
+namespace chatter {
+
+/* Unbounded multi-producer / single-consumer queue (Vyukov). push is one
+ * atomic exchange and never blocks; pop touches no shared state beyond the
+ * node it takes. Nodes come from a PacketPool.
+ *
+ * A push that is still in progress may not be visible to pop yet - it will be
+ * on a later call.
+ */
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue()
+    {
+        Node* stub = create_node(T());
+        m_head.store(stub, std::memory_order_relaxed);
+        m_tail = stub;
+    }
+
+    ~MpscQueue()
+    {
+        T value;
+        while (pop(value))
+            ;
+        destroy_node(m_tail);
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    /* Any thread */
+    void push(T value)
+    {
+        Node* node = create_node(std::move(value));
+        Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /* Consumer thread only. Returns false if the queue is empty. */
+    bool pop(T& out)
+    {
+        Node* tail = m_tail;
+        Node* next = tail->next.load(std::memory_order_acquire);
+
+        if (!next)
+            return false;
+
+        /* next becomes the new stub - take its value and free the old stub */
+        out = std::move(next->value);
+        next->value = T();
+        m_tail = next;
+        destroy_node(tail);
+
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        explicit Node(T&& v) : value(std::move(v)) {}
+
+        std::atomic<Node*> next{nullptr};
+        T value;
+    };
+
+    typedef PacketPool<Node> Allocator;
+
+    static Node* create_node(T&& value)
+    {
+        Allocator alloc;
+        Node* node = alloc.allocate(1);
+        alloc.construct(node, std::move(value));
+        return node;
+    }
+
+    static void destroy_node(Node* node)
+    {
+        Allocator alloc;
+        alloc.destroy(node);
+        alloc.deallocate(node, 1);
+    }
+
+    char m_pad0[64];
+    std::atomic<Node*> m_head;  //> Most recently pushed node, shared by producers
+    char m_pad1[64 - sizeof(std::atomic<Node*>)];
+    Node* m_tail;               //> Stub node ahead of the oldest value, consumer only
+    char m_pad2[64 - sizeof(Node*)];
+};
+
+} // namespace chatter
+
+#endif // _CH_MPSC_QUEUE_H_
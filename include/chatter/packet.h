@@ -5,6 +5,8 @@
 #include <vector>
 
 #include "chatter/types.h"
+#include "chatter/timer_wheel.h"
+#include "chatter/packetpool.h"
 
 namespace chatter {
 
@@ -20,7 +22,7 @@ struct PacketStats
     uint8_t channel;
     SeqNum sequence_number;
     uint32_t data_len;
-    uint16_t rto;
+    uint32_t rto;
     uint16_t send_count;
     bool send_queued;
 };
@@ -47,26 +49,68 @@ public:
     void write(float    data);
     void write(double   data);
 
-    void read(bool&     data);
-    void read(uint8_t&  data);
-    void read(int8_t&   data);
-    void read(uint16_t& data);
-    void read(int16_t&  data);
-    void read(uint32_t& data);
-    void read(int32_t&  data);
-    void read(uint64_t& data);
-    void read(int64_t&  data);
-    void read(float&    data);
-    void read(double&   data);
-
-    const uint8_t* data() const { return &m_data[0]; }
-    const std::size_t data_len() const { return m_data.size(); }
-    bool has_more_data() const { return m_read_pos < m_data.size(); }
+    /* Reads return false, leaving data untouched, when the payload is too
+     * short */
+    bool read(bool&     data);
+    bool read(uint8_t&  data);
+    bool read(int8_t&   data);
+    bool read(uint16_t& data);
+    bool read(int16_t&  data);
+    bool read(uint32_t& data);
+    bool read(int32_t&  data);
+    bool read(uint64_t& data);
+    bool read(int64_t&  data);
+    bool read(float&    data);
+    bool read(double&   data);
+
+    /* Bit packing. Bit fields are packed LSB first into the payload, and
+     * consecutive bit writes share bytes. Any byte-wise write or read (the
+     * above, or varints) first moves on to the next whole byte, so the two
+     * can be mixed as long as the reader mirrors the writer. */
+
+    /* Writes the low nbits (1 - 32) of value */
+    void write_bits(uint32_t value, int nbits);
+
+    /* Integer known to lie in [min, max], in as few bits as the range needs.
+     * Out of range values are clamped. */
+    void write_ranged(int32_t value, int32_t min, int32_t max);
+
+    /* Float in [min, max] quantized to nbits (1 - 32) evenly spaced steps.
+     * Out of range values are clamped. */
+    void write_quantized(float value, float min, float max, int nbits);
+
+    /* LEB128 - 7 bits per byte, small values in one byte */
+    void write_varint(uint64_t value);
+
+    /* Signed LEB128 with zigzag mapping, so small negative values stay small */
+    void write_zigzag(int64_t value);
+
+    /* The matching reads return false, leaving value untouched and the read
+     * position where it was, if the payload is too short or holds a value
+     * the writer could not have produced */
+    bool read_bits(uint32_t& value, int nbits);
+    bool read_ranged(int32_t& value, int32_t min, int32_t max);
+    bool read_quantized(float& value, float min, float max, int nbits);
+    bool read_varint(uint64_t& value);
+    bool read_zigzag(int64_t& value);
+
+    const uint8_t* data() const { return &m_buffer[kHeaderRoom]; }
+    const std::size_t data_len() const { return m_buffer.size() - kHeaderRoom; }
+    bool has_more_data() const { return m_read_pos < data_len(); }
+
+    /* TIMESTAMPED packets only. The sender's clock (us, wraps every ~71
+     * minutes) when the packet was handed to the protocol, and on receipt the
+     * estimated queueing plus network delay since then, from the peer's clock
+     * offset. The delay is only as good as the offset - roughly the RTT
+     * asymmetry. */
+    uint32_t timestamp() const { return m_timestamp; }
+    uint32_t one_way_delay() const { return m_one_way_delay; }
 
 private:
     friend class Peer;
     friend class Protocol;
     friend class Host;
+    friend class Dispatcher;
 
     void              set_type(PacketType type);
     PacketType        get_type();
@@ -76,25 +120,64 @@ private:
     void              set_channel(ProtocolChannelID chan);
     void              set_flag(PacketFlag flag);
     void              unset_flag(PacketFlag flag);
-
-    std::size_t       read_raw(uint8_t* buf, std::size_t buf_size);
+    void              set_sequence(SeqNum seq);
+    void              set_timestamp(uint32_t timestamp);
+    bool              has_sequence();     //> Reliable and sequenced packets carry a sequence number
+
+    std::size_t       header_len();
+    std::size_t       raw_len();
+    std::size_t       serialize();
+    const uint8_t*    wire() const { return &m_buffer[m_wire_offset]; }
+    uint8_t*          payload() { return &m_buffer[kHeaderRoom]; }
+    void              set_payload(const void* data, std::size_t data_len);
+    void              resize_payload(std::size_t data_len);
     void              append_bytes(const void* data, std::size_t data_len);
     bool              check_bounds(std::size_t data_len);
+    void              align_read();
 
     std::string       debug_string();
 
     ProtocolCommand m_cmd = 0;
     Peer* m_peer; /* either source or destination, depending on whether this packet was received or is being sent. */
-    std::vector<uint8_t> m_data;
-    std::size_t m_read_pos = 0;
-
-    uint16_t m_rto = 0;             //> Retransmission time-out (set by protocol each send)
+    std::vector<uint8_t> m_buffer;  //> kHeaderRoom bytes for the wire header, then the payload
+    std::size_t m_read_pos = 0;     //> Read position within the payload
+    int m_read_bit = 0;             //> Bits already read from the byte at m_read_pos
+    int m_write_bit = 0;            //> Bits used in the last payload byte, 0 when it is full
+    std::size_t m_wire_offset = 0;  //> Start of the serialized frame in m_buffer
+    std::size_t m_wire_len = 0;     //> Serialized frame length, 0 when the header needs (re)writing
+
+    uint32_t m_rto = 0;             //> Retransmission time-out (set by protocol each send)
     uint16_t m_send_count = 0;      //> Send count (set by host each send)
     uint64_t m_last_send_time = 0;  //> Timestamp of last send of this packet (set by host each send)
 
     bool m_send_queued = false;     //> Set by protocol when send is queued. Avoids re-queuing packets.
 
+    Timer m_resend_timer;           //> Retransmission deadline (reliable packets, armed each send)
+
     SeqNum m_sequence_num = 0;
+    uint32_t m_timestamp = 0;       //> Sender clock at send (TIMESTAMPED only)
+    uint32_t m_one_way_delay = 0;   //> Estimated on receipt (TIMESTAMPED only)
+
+    /* FRAGMENT only - fragment index of count, and the whole message length */
+    uint16_t m_fragment_index = 0;
+    uint16_t m_fragment_count = 0;
+    uint32_t m_fragment_total = 0;
+    const uint8_t* m_fragment_data = nullptr;   //> Received fragment payload, still in the receive buffer
+    std::size_t m_fragment_len = 0;
+
+    /* Wire framing - a datagram carries one or more frames back to back:
+     *   [cmd: 16][payload length: 16][sequence number: 32 (reliable or sequenced)]
+     *   [timestamp: 32 (timestamped)]
+     *   [fragment index: 16][fragment count: 16][message length: 32 (fragment)][payload]
+     * A PROTO_SPLIT payload starts with
+     *   [split id: 16][piece index: 8][piece count: 8][frame length: 16]
+     */
+    static const std::size_t kFrameHeaderLen = sizeof(ProtocolCommand) + sizeof(uint16_t);
+    static const std::size_t kFragmentHeaderLen = sizeof(uint16_t) * 2 + sizeof(uint32_t);
+    static const std::size_t kSplitHeaderLen = sizeof(uint16_t) * 2 + sizeof(uint8_t) * 2;
+
+    /* Space reserved ahead of the payload so the header can be written in place */
+    static const std::size_t kHeaderRoom = 32;
 
     static const int kPacketTypeShift = 11; /* >> 11 */
     static const int kPacketFlagShift = 5;  /* >> 5 */
@@ -1,14 +1,190 @@
 #ifndef _CH_PACKETPOOL_H_
 #define _CH_PACKETPOOL_H_
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
 namespace chatter {
 
+struct PoolStats
+{
+    std::size_t chunks;     //> Slabs allocated
+    std::size_t capacity;   //> Blocks across all slabs
+    std::size_t in_use;     //> Blocks currently handed out
+    std::size_t overflow;   //> Blocks currently handed out from the heap, once the slabs ran out
+};
+
+/* Occupancy counters, shared by every pool allocating on behalf of Tag */
+template <typename Tag>
+struct PoolCounters
+{
+    static PoolCounters& instance()
+    {
+        static PoolCounters counters;
+        return counters;
+    }
+
+    std::atomic<std::size_t> chunks{0};
+    std::atomic<std::size_t> capacity{0};
+    std::atomic<std::size_t> in_use{0};
+    std::atomic<std::size_t> overflow{0};
+};
+
+/* Header at the start of every slab */
 struct PoolChunk
 {
+    std::size_t index;  //> Position in the pool's slab table
+};
+
+/* Fixed size block store. Blocks are carved from slabs of chunk_size blocks
+ * and kept on a lock-free free list, so any thread may allocate or release.
+ * Blocks are addressed by index (stored just ahead of each block), and the
+ * list head carries a tag that changes on every update to rule out ABA.
+ * Slabs are never returned to the system. Once kMaxChunks slabs are in use,
+ * further blocks come from the heap and go back to it when released.
+ */
+template <std::size_t block_size, std::size_t block_align, typename Tag, std::size_t chunk_size>
+class PoolStorage
+{
+public:
+    static PoolStorage& instance()
+    {
+        /* Deliberately leaked - blocks may be released during static destruction */
+        static PoolStorage* storage = new PoolStorage();
+        return *storage;
+    }
+
+    void* allocate()
+    {
+        for (;;) {
+            uint64_t head = m_free_head.load(std::memory_order_acquire);
+            uint32_t index = static_cast<uint32_t>(head);
+
+            if (!index) {
+                if (!grow())
+                    return allocate_overflow();
+                continue;
+            }
+
+            uint32_t next = link(index - 1)->load(std::memory_order_relaxed);
+            uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+
+            if (m_free_head.compare_exchange_weak(head, new_head, std::memory_order_acq_rel)) {
+                PoolCounters<Tag>::instance().in_use++;
+                return block(index - 1) + kPrefixSize;
+            }
+        }
+    }
+
+    void deallocate(void* p)
+    {
+        uint8_t* prefix = static_cast<uint8_t*>(p) - kPrefixSize;
+        uint32_t index = *reinterpret_cast<uint32_t*>(prefix);
+
+        if (index == kOverflowIndex) {
+            ::operator delete(prefix);
+            PoolCounters<Tag>::instance().overflow--;
+            return;
+        }
+
+        push(index, index);
+        PoolCounters<Tag>::instance().in_use--;
+    }
+
+private:
+    static const std::size_t kMaxChunks = 4096;
+    static const uint32_t kOverflowIndex = UINT32_MAX;    //> Prefix of a block taken from the heap
+    static const std::size_t kPrefixSize = (sizeof(uint32_t) + block_align - 1) / block_align * block_align;
+    static const std::size_t kBlockStride = kPrefixSize +
+        ((block_size > sizeof(std::atomic<uint32_t>) ? block_size : sizeof(std::atomic<uint32_t>))
+         + block_align - 1) / block_align * block_align;
+    static const std::size_t kHeaderSize = (sizeof(PoolChunk) + block_align - 1) / block_align * block_align;
+
+    PoolStorage() = default;
+
+    /* The slabs are exhausted - hand out a heap block with the same prefix
+     * layout, marked so deallocate returns it to the heap */
+    void* allocate_overflow()
+    {
+        uint8_t* prefix = static_cast<uint8_t*>(::operator new(kBlockStride));
+        *reinterpret_cast<uint32_t*>(prefix) = kOverflowIndex;
+        PoolCounters<Tag>::instance().overflow++;
+        return prefix + kPrefixSize;
+    }
+
+    uint8_t* block(uint32_t index)
+    {
+        uint8_t* chunk = reinterpret_cast<uint8_t*>(m_chunks[index / chunk_size].load(std::memory_order_acquire));
+        return chunk + kHeaderSize + (index % chunk_size) * kBlockStride;
+    }
+
+    /* A free block holds the (index + 1) of the next free block */
+    std::atomic<uint32_t>* link(uint32_t index)
+    {
+        return reinterpret_cast<std::atomic<uint32_t>*>(block(index) + kPrefixSize);
+    }
+
+    /* Pushes the chain first -> ... -> last (already linked) onto the free list */
+    void push(uint32_t first, uint32_t last)
+    {
+        uint64_t head = m_free_head.load(std::memory_order_relaxed);
+        uint64_t new_head;
+
+        do {
+            link(last)->store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+            new_head = ((head >> 32) + 1) << 32 | (first + 1);
+        } while (!m_free_head.compare_exchange_weak(head, new_head, std::memory_order_acq_rel));
+    }
+
+    bool grow()
+    {
+        std::lock_guard<std::mutex> lock(m_grow_mutex);
+
+        if (static_cast<uint32_t>(m_free_head.load(std::memory_order_acquire)))
+            return true; /* Another thread refilled the list */
+
+        std::size_t count = m_chunk_count;
+        if (count == kMaxChunks)
+            return false;
+        m_chunk_count++;
+
+        PoolChunk* chunk = static_cast<PoolChunk*>(::operator new(kHeaderSize + chunk_size * kBlockStride));
+        chunk->index = count;
+        m_chunks[count].store(chunk, std::memory_order_release);
+
+        uint32_t first = static_cast<uint32_t>(count * chunk_size);
+        for (std::size_t i = 0; i < chunk_size; ++i) {
+            *reinterpret_cast<uint32_t*>(block(first + i)) = first + i;
+            if (i + 1 < chunk_size)
+                link(first + i)->store(first + i + 2, std::memory_order_relaxed);
+        }
+        push(first, first + chunk_size - 1);
+
+        PoolCounters<Tag>& counters = PoolCounters<Tag>::instance();
+        counters.chunks++;
+        counters.capacity += chunk_size;
+
+        return true;
+    }
 
-}
+    std::atomic<uint64_t> m_free_head{0};   //> [tag: 32][index + 1: 32], 0 index = empty
+    std::atomic<PoolChunk*> m_chunks[kMaxChunks] = {};
+    std::size_t m_chunk_count = 0;          //> Guarded by m_grow_mutex
+    std::mutex m_grow_mutex;
+};
 
-template <typename T, size_t chunk_size = 128>
+/* Allocator handing out single objects from a PoolStorage. Intended for
+ * std::allocate_shared, which rebinds it to its control block type - Tag is
+ * carried through the rebind so stats() reports for the original type.
+ * Array allocations fall back to the global heap.
+ */
+template <typename T, typename Tag = T, std::size_t chunk_size = 128>
 class PacketPool
 {
 public:
@@ -25,28 +201,66 @@ public:
 
     template <typename U> struct rebind
     {
-        typedef PacketPool<U> other;
+        typedef PacketPool<U, Tag, chunk_size> other;
     };
 
-    PacketPool() noexcept;
-    PacketPool(const PacketPool& packet_pool) noexcept;
-    PacketPool(PacketPool&& packet_pool) noexcept;
-    template <class U> PacketPool(const PacketPool<U>& packet_pool) noexcept;
-    ~PacketPool() noexcept;
+    PacketPool() noexcept {}
+    PacketPool(const PacketPool& packet_pool) noexcept {}
+    PacketPool(PacketPool&& packet_pool) noexcept {}
+    template <class U> PacketPool(const PacketPool<U, Tag, chunk_size>& packet_pool) noexcept {}
+    ~PacketPool() noexcept {}
 
     PacketPool& operator=(const PacketPool& packet_pool) = delete;
-    PacketPool& operator=(PacketPool&& packet_pool) noexcept;
+    PacketPool& operator=(PacketPool&& packet_pool) noexcept { return *this; }
+
+    pointer address(reference t) const noexcept { return &t; }
+    const_pointer address(const_reference t) const noexcept { return &t; }
+
+    pointer allocate(size_type n = 1, const_pointer hint = nullptr)
+    {
+        if (n != 1)
+            return static_cast<pointer>(::operator new(n * sizeof(T)));
+        return static_cast<pointer>(storage().allocate());
+    }
+
+    void deallocate(pointer p, size_type n = 1)
+    {
+        if (n != 1)
+            ::operator delete(p);
+        else
+            storage().deallocate(p);
+    }
+
+    size_type max_size() const noexcept { return std::numeric_limits<size_type>::max() / sizeof(T); }
 
-    pointer address(reference t) const noexcept;
-    const_pointer address(const_reference t) const noexcept;
-    pointer allocate(size_type n = 1, const_pointer hint = nullptr);
-    void deallocate(pointer p, size_type n = 1);
-    size_type max_size() const noexcept;
+    template <class U, class... Args> void construct(U* p, Args&&... args)
+    {
+        new (p) U(std::forward<Args>(args)...);
+    }
+
+    template <class U> void destroy(U* p)
+    {
+        p->~U();
+    }
 
-    template <class U, class... Args> void construct(U* p, Args&&... args);
-    template <class U> void destroy(U* p);
+    static PoolStats stats()
+    {
+        PoolCounters<Tag>& counters = PoolCounters<Tag>::instance();
+        return PoolStats{counters.chunks.load(), counters.capacity.load(), counters.in_use.load(),
+                         counters.overflow.load()};
+    }
+
+private:
+    typedef PoolStorage<sizeof(T), alignof(T), Tag, chunk_size> Storage;
+
+    static Storage& storage() { return Storage::instance(); }
 };
 
+template <typename T, typename U, typename Tag, std::size_t chunk_size>
+inline bool operator==(const PacketPool<T, Tag, chunk_size>&, const PacketPool<U, Tag, chunk_size>&) { return true; }
+
+template <typename T, typename U, typename Tag, std::size_t chunk_size>
+inline bool operator!=(const PacketPool<T, Tag, chunk_size>&, const PacketPool<U, Tag, chunk_size>&) { return false; }
 
 } // namespace chatter
 
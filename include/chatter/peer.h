@@ -1,11 +1,15 @@
 #ifndef _CH_PEER_H_
 #define _CH_PEER_H_
 
+#include <list>
 #include <vector>
 
 #include "chatter/types.h"
 #include "chatter/hostaddress.h"
 #include "chatter/protocol.h"
+#include "chatter/timer_wheel.h"
+#include "chatter/congestion.h"
+#include "chatter/config.h"
 
 namespace chatter {
 
@@ -15,16 +19,21 @@ struct PeerStats
     HostAddress address;
     bool incoming_connection;
     uint64_t connect_time;
-    uint16_t rtt_avg;
-    uint16_t rtt_dev;
+    uint32_t rtt_avg;
+    uint32_t rtt_dev;
+    int64_t clock_offset;       //> Peer clock minus ours (us)
     uint32_t congestion_window;
     uint32_t bytes_on_wire;
+    uint16_t mtu;               //> Path MTU confirmed by probing
+    uint64_t pacing_rate;       //> Bytes/s, 0 if unpaced
 };
 
 class Peer
 {
 public:
     Peer();
+    Peer(Peer&&) = default;
+    Peer& operator=(Peer&&) = default;
     ~Peer() {}
 
     const HostAddress& get_address();
@@ -34,12 +43,43 @@ private:
     friend class Protocol;
 
     Packet::ptr ack_packet(ProtocolChannelID channel_id, SeqNum sequence);
+    void ack_packets(ProtocolChannelID channel_id, SeqNum cumulative, uint64_t sack_mask, std::vector<Packet::ptr>& acked);
+
+    /* Records receipt of a reliable packet. Returns false for duplicates and
+     * sequence numbers outside the receive window. */
+    bool record_received(ProtocolChannelID channel_id, SeqNum sequence);
+
+    /* Records receipt of an unreliable sequenced packet. Returns false if it is
+     * older than (or the same as) the newest already delivered on its channel. */
+    bool record_sequenced(ProtocolChannelID channel_id, SeqNum sequence);
     void reset();
 
+    /* Clock offset sample from a pong - the peer read remote_now somewhere
+     * between our ping at sent and the pong at received */
+    void update_clock_offset(uint64_t sent, uint64_t remote_now, uint64_t received);
+
+    /* Estimated delay (us) since a peer timestamp, taken at timestamp now on
+     * our clock */
+    uint32_t one_way_delay(uint64_t now, uint32_t remote_timestamp);
+
     /* Calculates retransmission timeout to be set for a packet */
-    uint16_t get_rto();
+    uint32_t get_rto();
+
+    void set_congestion_control(CongestionAlgorithm algorithm);
 
-    bool congestion_window_full() { return m_bytes_on_wire >= m_congestion_window; }
+    /* Largest datagram (UDP payload) that can be sent to this peer */
+    std::size_t max_datagram() const { return m_mtu - kUDPHeaderSize; }
+    void set_mtu(uint16_t mtu);
+    bool congestion_window_full() { return m_bytes_on_wire >= m_congestion->window(); }
+
+    /* True if the receiver has room for the packet's sequence number */
+    bool receive_window_open(const Packet::ptr& packet);
+
+    /* True if a paced packet may be sent at timestamp */
+    bool pacing_ready(uint64_t timestamp) { return m_pacing_ts <= timestamp; }
+
+    /* Accounts a paced send of bytes, pushing back when the next may go */
+    void pacing_sent(uint64_t timestamp, std::size_t bytes);
 
     PeerState       m_state = PeerState::DISCONNECTED;
     PeerID          m_id = 0;
@@ -52,11 +92,38 @@ private:
     uint64_t        m_last_ping_ts;             //> Timestamp of last ping sent
     uint64_t        m_last_rtt_ts;              //> Timestamp of last rtt calculation
 
-    uint16_t        m_rtt_avg;                  //> Round trip time average
-    uint16_t        m_rtt_dev;                  //> Round trip time deviation
+    uint32_t        m_rtt_avg;                  //> Round trip time average (us)
+    uint32_t        m_rtt_dev;                  //> Round trip time deviation (us)
+
+    int64_t         m_clock_offset;             //> Peer clock minus ours (us), smoothed
+    uint32_t        m_clock_offset_rtt;         //> Round trip of the best recent offset sample, 0 if none
+    uint64_t        m_clock_sync_ts;            //> Timestamp of last clock offset sample
 
-    uint32_t        m_congestion_window;        //> Limit bytes in flight on the wire
+    std::unique_ptr<CongestionController> m_congestion; //> Limits bytes in flight on the wire
     uint32_t        m_bytes_on_wire;
+    uint64_t        m_recovery_ts;              //> Start of the current loss event - losses of packets sent before it belong to it
+    uint64_t        m_rack_ts;                  //> Send time of the most recently sent packet acked (first sends only)
+    uint64_t        m_pacing_ts;                //> Earliest time the next paced packet may be sent
+
+    uint16_t        m_mtu;                      //> Path MTU confirmed to reach the peer
+    uint16_t        m_mtu_ceiling;              //> Largest MTU not yet ruled out by probing
+    uint16_t        m_mtu_probe;                //> Size of the outstanding probe, 0 if none
+    int             m_mtu_probe_count;          //> Probes of m_mtu_probe sent without a reply
+    bool            m_mtu_settled;              //> Search finished - m_mtu_timer is the next attempt to raise it
+    bool            m_mtu_search_started;       //> The peer has answered since connecting, so probes can be judged
+
+    int             m_batch_slot;               //> Send batch datagram open for this peer (-1 if none)
+    uint16_t        m_split_id;                 //> Identifies the next frame we send in PROTO_SPLIT pieces
+    std::vector<SplitAssembly> m_splits;        //> Frames the peer sent in pieces, still incomplete
+
+    bool            m_claimed = false;          //> Taken from the host's free slots
+    std::list<Packet::ptr> m_send_queue;        //> User data held back by the windows or pacing
+    bool            m_send_due = false;         //> Listed in the host's m_send_due
+
+    Timer           m_service_timer;            //> Next connect timeout / peer timeout / ping deadline
+    Timer           m_ack_timer;                //> Delayed ack deadline
+    Timer           m_pacing_timer;             //> Next paced send, while packets are held back by pacing
+    Timer           m_mtu_timer;                //> MTU probe time-out, or the next search once settled
 
     /* 0 -> 31 for ordered packets. 32 for unordered reliable */
     ProtocolChannel m_channels[33];
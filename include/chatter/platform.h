@@ -8,35 +8,88 @@
 #include "chatter/hostaddress.h"
 
 #define CH_SOCKET_NULL -1
+#define CH_WAKE_EVENT_NULL -1
+#define CH_POLLER_NULL -1
+#define CH_DEADLINE_TIMER_NULL -1
 #define CH_ADDR_ANY INADDR_ANY
 #define CH_PORT_ANY 0
 
 namespace chatter {
 
 typedef int Socket;
+typedef int WakeEvent;
+typedef int Poller;
+typedef int DeadlineTimer;
 
 enum class SocketOption
 {
     NONBLOCK,
     BROADCAST,
     REUSEADDR,
+    REUSEPORT,
     RCVBUF,
     SNDBUF,
     RCVTIMEO,
     SNDTIMEO,
+    DONT_FRAGMENT,  //> Set DF on outgoing datagrams, for path MTU probing
 #if 0
     NODELAY
 #endif
 };
 
+/* Contiguous piece of an outgoing datagram */
+struct DatagramSegment
+{
+    const void* buf;
+    std::size_t len;
+};
+
+/* A single datagram slot for batched socket calls. On receive, buf_len is the
+ * capacity of buf and msg_len / address are filled in by the platform layer.
+ * On send, the segment_count segments are gathered and sent to address, or
+ * msg_len bytes of buf if there are no segments.
+ */
+struct Datagram
+{
+    void* buf;
+    std::size_t buf_len;
+    std::size_t msg_len;
+    HostAddress address;
+    const DatagramSegment* segments = nullptr;
+    std::size_t segment_count = 0;
+};
+
 namespace platform {
 
 Socket SocketCreate();
 void SocketDestroy(Socket socket);
 bool SocketSetOption(Socket socket, SocketOption option, int value);
 bool SocketBind(Socket socket, const HostAddress& address);
+bool SocketGetAddress(Socket socket, HostAddress* address);
+bool SocketWaitReadable(Socket socket, int timeout_ms); // timeout_ms < 0 waits forever
 ssize_t SocketSendTo(Socket socket, const void *buf, size_t buf_len, const HostAddress& address);
 ssize_t SocketRecvFrom(Socket socket, void *buf, size_t buf_len, HostAddress* address);
+int SocketRecvBatch(Socket socket, Datagram* datagrams, std::size_t count);
+int SocketSendBatch(Socket socket, const Datagram* datagrams, std::size_t count);
+
+/* Cross-thread wakeup. Signals are sticky until a wait consumes them. */
+WakeEvent WakeEventCreate();
+void WakeEventDestroy(WakeEvent event);
+void WakeEventSignal(WakeEvent event);
+bool WakeEventWait(WakeEvent event, int64_t timeout_us); // True if signalled, -1 waits forever
+
+/* One-shot timer that becomes readable when it expires */
+DeadlineTimer DeadlineTimerCreate();
+void DeadlineTimerDestroy(DeadlineTimer timer);
+void DeadlineTimerArm(DeadlineTimer timer, uint64_t delay_us);
+void DeadlineTimerDisarm(DeadlineTimer timer);
+void DeadlineTimerConsume(DeadlineTimer timer);
+
+/* Readiness notification for sockets, wake events and deadline timers */
+Poller PollerCreate();
+void PollerDestroy(Poller poller);
+bool PollerAdd(Poller poller, int fd);
+int PollerWait(Poller poller, int* ready_fds, int max_ready, int timeout_ms); // Number of readable fds
 
 bool HostAddressStringToNet32(const std::string address, uint32_t *out);
 std::string Net32ToString(uint32_t address_net);
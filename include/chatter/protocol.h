@@ -2,19 +2,57 @@
 #define _CH_PROTOCOL_H_
 
 #include <list>
+#include <bitset>
+#include <vector>
 
+#include "chatter/config.h"
 #include "chatter/packet.h"
+#include "chatter/sequence_buffer.h"
+#include "chatter/timer_wheel.h"
 
 namespace chatter {
 
 class Host;
 class Peer;
 
+/* A fragmented message being reassembled. Its fragments carry consecutive
+ * sequence numbers, so the first one identifies the message. */
+struct FragmentAssembly
+{
+    SeqNum first;
+    uint16_t count;
+    uint16_t received;
+    std::vector<uint64_t> bitmap;   //> Bit i is set once fragment i has been copied in
+    Packet::ptr packet;             //> Destination - payload allocated for the whole message up front
+};
+
+/* The frame of a packet resent in PROTO_SPLIT pieces, being put back
+ * together before it is handled like any other */
+struct SplitAssembly
+{
+    uint16_t id;
+    uint8_t count;
+    uint8_t received;
+    uint32_t bitmap;                //> Bit i is set once piece i has been copied in
+    std::vector<uint8_t> frame;
+};
+
 struct ProtocolChannel
 {
     ProtocolChannelID id;
     SeqNum next_sequence;
-    std::list<Packet::ptr> sent_reliable;
+    SequenceBuffer<Packet::ptr> sent_reliable; //> Unacked reliable packets by sequence number
+    SeqNum send_limit;                         //> First sequence number beyond the receiver's advertised window
+    SeqNum next_sequenced;                     //> Sequence numbers for unreliable sequenced packets - a separate space
+
+    /* Receive side: every sequence number below recv_next has been received,
+     * recv_window marks those received ahead of it (indexed by seq % size). */
+    SeqNum recv_next;
+    std::bitset<kReceiveWindowSize> recv_window;
+    SequenceBuffer<Packet::ptr> recv_held;     //> Ordered packets received ahead of a gap, released once it fills
+    SeqNum recv_sequenced_next;                //> One past the newest unreliable sequenced packet delivered
+    std::vector<FragmentAssembly> assemblies;  //> Fragmented messages still missing pieces
+    bool ack_pending;
 };
 
 class Protocol
@@ -23,11 +61,17 @@ public:
     Protocol(Host* host);
     ~Protocol();
 
+    void reset(uint64_t timestamp);
     bool connect(Peer* peer);
     bool disconnect(Peer* peer);
     void handle_message(Peer* peer, const uint8_t* msg, std::size_t msg_size);
-    void update(Peer* peer, uint64_t timestamp);
+    void service_timers(uint64_t timestamp);
+    uint64_t next_deadline() { return m_timers.next_expiry(); } // UINT64_MAX if nothing is scheduled
     void send(Packet::ptr packet, bool immediate = false);
+    void packet_sent(const Packet::ptr& packet);
+
+    /* Wakes the network thread when the peer's next paced send is due */
+    void schedule_pacing(Peer* peer);
 
 private:
     std::vector<Packet::ptr> parse_message(Peer* peer, const uint8_t* msg, std::size_t msg_size);
@@ -40,14 +84,33 @@ private:
     bool handle_connect_complete(const Packet::ptr packet);
     bool handle_disconnect_notify(const Packet::ptr packet);
     bool handle_user_data(const Packet::ptr packet);
-    void send_ack(Packet::ptr packet);
+    void release_ordered(const Packet::ptr packet);
+    void send_fragments(Packet::ptr packet, bool immediate);
+    bool admit_fragment(const Packet::ptr packet);
+    bool store_fragment(const Packet::ptr packet);
+    void complete_fragment(const Packet::ptr packet);
+    bool handle_split(const Packet::ptr packet);
+    bool send_ack(Packet::ptr packet);
+    void flush_acks(Peer* peer, bool immediate = false);
+    void update(Peer* peer, uint64_t timestamp);
+    void schedule_update(Peer* peer);
     bool detect_disconnect(Peer* peer, uint64_t timestamp);
     void service_rtt(Peer* peer, uint64_t timestamp);
-    void do_resends(Peer* peer, uint64_t timestamp);
+    void send_ping(Peer* peer, uint64_t timestamp);
+    void service_mtu(Peer* peer, uint64_t timestamp);
+    void start_mtu_search(Peer* peer, uint64_t timestamp);
+    void peer_answering(Peer* peer, uint64_t timestamp);
+    void do_resend(Packet::ptr packet, uint64_t timestamp);
+    void detect_losses(Peer* peer, ProtocolChannelID channel_id, SeqNum highest_acked, uint64_t timestamp);
+    void enter_recovery(Peer* peer, const Packet::ptr& packet, uint64_t timestamp);
     void calculate_rtt(Peer* peer, uint64_t measurement);
-    uint16_t limit_rto(uint16_t rto);
+    uint32_t limit_rto(uint64_t rto);
 
     Host* m_host;
+
+    TimerWheel m_timers;              //> Peer service, delayed ack and retransmission deadlines
+    std::vector<Packet::ptr> m_acked; //> Scratch list of packets released by an ack
+    bool m_in_split = false;          //> Handling a reassembled frame - splits are never nested
 };
 
 } // namespace chatter
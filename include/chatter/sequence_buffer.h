@@ -0,0 +1,145 @@
+#ifndef _CH_SEQUENCE_BUFFER_H_
+#define _CH_SEQUENCE_BUFFER_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "chatter/types.h"
+
+namespace chatter {
+
+/* Ring buffer of values indexed by sequence number modulo its capacity.
+ * Covers the sequence range [head, tail) - insert, find and remove are O(1).
+ * The capacity is always a power of two and doubles when an insert falls
+ * outside the current ring.
+ */
+template <typename T>
+class SequenceBuffer
+{
+public:
+    explicit SequenceBuffer(std::size_t capacity = 64)
+    {
+        std::size_t cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+        m_slots.resize(cap);
+        m_used.resize(cap, 0);
+    }
+
+    bool empty() const { return m_count == 0; }
+    std::size_t size() const { return m_count; }
+    std::size_t capacity() const { return m_slots.size(); }
+
+    /* Oldest sequence number held (only meaningful when not empty) */
+    SeqNum head() const { return m_head; }
+
+    /* One past the newest sequence number held */
+    SeqNum tail() const { return m_tail; }
+
+    void clear()
+    {
+        for (std::size_t i = 0; i < m_slots.size(); ++i) {
+            m_slots[i] = T();
+            m_used[i] = 0;
+        }
+        m_count = 0;
+        m_head = m_tail = 0;
+    }
+
+    /* Stores value at seq. A sequence number older than head extends the
+     * ring backwards, so values may arrive in any order. */
+    bool insert(SeqNum seq, const T& value)
+    {
+        if (empty()) {
+            m_head = seq;
+            m_tail = seq;
+        }
+        else if (sequence_less_than(seq, m_head)) {
+            while (m_tail - seq > m_slots.size())
+                grow();
+            m_head = seq;
+        }
+
+        while (seq - m_head >= m_slots.size())
+            grow();
+
+        std::size_t idx = index(seq);
+        if (!m_used[idx])
+            m_count++;
+        m_slots[idx] = value;
+        m_used[idx] = 1;
+
+        if (!sequence_less_than(seq, m_tail))
+            m_tail = seq + 1;
+
+        return true;
+    }
+
+    T* find(SeqNum seq)
+    {
+        if (!contains(seq))
+            return nullptr;
+        return &m_slots[index(seq)];
+    }
+
+    bool contains(SeqNum seq) const
+    {
+        if (empty() || seq - m_head >= m_tail - m_head)
+            return false;
+        return m_used[index(seq)] != 0;
+    }
+
+    /* Removes the value at seq, moving it to out if given */
+    bool remove(SeqNum seq, T* out = nullptr)
+    {
+        if (!contains(seq))
+            return false;
+
+        std::size_t idx = index(seq);
+        if (out)
+            *out = std::move(m_slots[idx]);
+        m_slots[idx] = T();
+        m_used[idx] = 0;
+        m_count--;
+
+        /* Keep head on an occupied slot */
+        if (!m_count)
+            m_head = m_tail;
+        else if (seq == m_head)
+            while (!m_used[index(m_head)])
+                m_head++;
+
+        return true;
+    }
+
+private:
+    std::size_t index(SeqNum seq) const { return seq & (m_slots.size() - 1); }
+
+    void grow()
+    {
+        std::vector<T> slots(m_slots.size() * 2);
+        std::vector<uint8_t> used(m_used.size() * 2, 0);
+
+        for (SeqNum seq = m_head; seq != m_tail; ++seq) {
+            std::size_t idx = index(seq);
+            if (!m_used[idx])
+                continue;
+            std::size_t new_idx = seq & (slots.size() - 1);
+            slots[new_idx] = std::move(m_slots[idx]);
+            used[new_idx] = 1;
+        }
+
+        m_slots.swap(slots);
+        m_used.swap(used);
+    }
+
+    std::vector<T> m_slots;
+    std::vector<uint8_t> m_used;
+    std::size_t m_count = 0;
+    SeqNum m_head = 0;
+    SeqNum m_tail = 0;
+};
+
+} // namespace chatter
+
+#endif // _CH_SEQUENCE_BUFFER_H_
@@ -0,0 +1,98 @@
+#ifndef _CH_SPSC_RING_H_
+#define _CH_SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace chatter {
+
+/* Fixed capacity single-producer / single-consumer ring of preallocated slots.
+ * The producer fills slots in place and publishes them, the consumer reads
+ * them in place and releases them - no locks and no copies through the ring.
+ * The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(std::size_t capacity = 0)
+    {
+        resize(capacity);
+    }
+
+    /* Discards the contents - only while neither side is using the ring */
+    void resize(std::size_t capacity)
+    {
+        std::size_t cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+        if (!capacity)
+            cap = 0;
+
+        m_slots.clear();
+        m_slots.shrink_to_fit();
+        m_slots.resize(cap);
+        m_mask = cap ? cap - 1 : 0;
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+    }
+
+    std::size_t capacity() const { return m_slots.size(); }
+
+    /* Producer side */
+
+    /* Number of slots the producer may fill */
+    std::size_t writable() const
+    {
+        return capacity() - (m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_acquire));
+    }
+
+    /* The offset'th unpublished slot, offset < writable() */
+    T& write_slot(std::size_t offset)
+    {
+        return m_slots[(m_tail.load(std::memory_order_relaxed) + offset) & m_mask];
+    }
+
+    /* Hands the next count filled slots to the consumer */
+    void publish(std::size_t count)
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    /* Consumer side */
+
+    /* Number of published slots waiting to be read */
+    std::size_t readable() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_relaxed);
+    }
+
+    /* The offset'th published slot, offset < readable() */
+    T& read_slot(std::size_t offset)
+    {
+        return m_slots[(m_head.load(std::memory_order_relaxed) + offset) & m_mask];
+    }
+
+    /* Returns the next count read slots to the producer */
+    void release(std::size_t count)
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+private:
+    std::vector<T> m_slots;
+    std::size_t m_mask;
+
+    /* Padded onto separate cache lines so the two threads don't contend. Padding
+     * rather than alignas, so owners can still be heap allocated pre C++17. */
+    char m_pad0[64];
+    std::atomic<std::size_t> m_head{0};    //> Next slot to read, written by the consumer
+    char m_pad1[64 - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> m_tail{0};    //> Next slot to fill, written by the producer
+    char m_pad2[64 - sizeof(std::atomic<std::size_t>)];
+};
+
+} // namespace chatter
+
+#endif // _CH_SPSC_RING_H_
@@ -0,0 +1,89 @@
+#ifndef _CH_TIMER_WHEEL_H_
+#define _CH_TIMER_WHEEL_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace chatter {
+
+/* Intrusive timer entry - embedded in the object that owns the deadline.
+ * Copies are never linked into a wheel, and destruction unlinks.
+ */
+struct Timer
+{
+    Timer() = default;
+    Timer(const Timer&) : type(0), owner(nullptr) {}
+    Timer& operator=(const Timer&) { return *this; }
+    ~Timer() { cancel(); }
+
+    bool scheduled() const { return m_next != nullptr; }
+    uint64_t deadline() const { return m_deadline; }
+
+    void cancel()
+    {
+        if (!m_next)
+            return;
+        m_prev->m_next = m_next;
+        m_next->m_prev = m_prev;
+        m_prev = m_next = nullptr;
+    }
+
+    int type = 0;           //> Set by the owner to identify the timer when it expires
+    void* owner = nullptr;  //> Set by the owner to find itself when the timer expires
+
+private:
+    friend class TimerWheel;
+
+    Timer* m_prev = nullptr;
+    Timer* m_next = nullptr;
+    uint64_t m_deadline = 0;
+    uint64_t m_tick = 0;
+};
+
+/* Hierarchical timing wheel. Level 0 has one slot per tick, each level above
+ * covers kSlots times the span of the one below. Timers cascade down a level
+ * as their slot comes round, so advancing only touches expired timers and
+ * those due to move down a level.
+ *
+ * Not thread safe - owned by the network thread.
+ */
+class TimerWheel
+{
+public:
+    explicit TimerWheel(uint64_t tick_len = 1);
+
+    /* Discards all timers and restarts the wheel at the given time */
+    void reset(uint64_t now);
+
+    /* (Re)schedules timer to expire at deadline. Deadlines in the past expire
+     * on the next tick. */
+    void schedule(Timer* timer, uint64_t deadline);
+
+    /* Returns the next timer due at or before now, or nullptr once none are
+     * left. The timer is unlinked before it is returned, so it may be
+     * rescheduled straight away. */
+    Timer* expire(uint64_t now);
+
+    /* Earliest time expire() could next return a timer - exact for timers due
+     * within kSlots ticks, otherwise the time their slot cascades. Returns
+     * UINT64_MAX if no timers are scheduled. */
+    uint64_t next_expiry();
+
+private:
+    static const int kLevels = 4;
+    static const int kSlotBits = 6;
+    static const uint64_t kSlots = 1 << kSlotBits;
+    static const uint64_t kSlotMask = kSlots - 1;
+
+    void insert(Timer* timer);
+    void cascade(int level);
+    Timer* slot(int level, uint64_t tick);
+
+    uint64_t m_tick_len;
+    uint64_t m_current = 0;         //> Tick currently being expired
+    std::vector<Timer> m_slots;     //> List heads, kLevels * kSlots
+};
+
+} // namespace chatter
+
+#endif // _CH_TIMER_WHEEL_H_
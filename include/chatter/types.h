@@ -12,6 +12,12 @@ typedef uint32_t PeerID;
 typedef uint16_t ProtocolCommand;
 typedef uint8_t  ProtocolChannelID;
 
+/* Sequence number comparison that survives wrap-around */
+inline bool sequence_less_than(SeqNum a, SeqNum b)
+{
+    return static_cast<int32_t>(a - b) < 0;
+}
+
 enum class PeerState {
     DISCONNECTED,
     CONNECTION_REQUESTED,
@@ -32,6 +38,17 @@ enum class PacketType
     PROTO_PONG,
     DISCONNECT_NOTIFY,
     USER_DATA,      /* <-> */
+    PROTO_SPLIT,
+};
+
+/* Identifies protocol timers (Timer::type) when they expire */
+enum TimerType
+{
+    PEER_SERVICE,
+    PEER_ACK,
+    PEER_PACING,
+    PEER_MTU_PROBE,
+    PACKET_RESEND,
 };
 
 enum PacketFlag
@@ -40,6 +57,7 @@ enum PacketFlag
     ORDERED     = 1 << 1,
     SEQUENCED   = 1 << 2,
     TIMESTAMPED = 1 << 3,
+    FRAGMENT    = 1 << 4,   /* Set by the protocol on the pieces of a message too large for one datagram */
 };
 
 } // namespace chatter
@@ -0,0 +1,284 @@
+#include "chatter/congestion.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "chatter/config.h"
+
+namespace chatter {
+
+std::unique_ptr<CongestionController> CongestionController::create(CongestionAlgorithm algorithm)
+{
+    switch (algorithm) {
+        case CongestionAlgorithm::CUBIC:
+            return std::unique_ptr<CongestionController>(new CubicController());
+        case CongestionAlgorithm::DELIVERY_RATE:
+            return std::unique_ptr<CongestionController>(new DeliveryRateController());
+        case CongestionAlgorithm::RENO:
+        default:
+            return std::unique_ptr<CongestionController>(new RenoController());
+    }
+}
+
+/* Pacing gains - slow start paces ahead of the window so it can still double
+ * each round trip, congestion avoidance leaves a little headroom (as Linux) */
+static const double kSlowStartPacingGain = 2.0;
+static const double kPacingGain = 1.25;
+
+uint64_t CongestionController::pacing_rate(uint32_t srtt) const
+{
+    return window_rate(window(), srtt, kPacingGain);
+}
+
+uint64_t CongestionController::window_rate(uint32_t window, uint32_t srtt, double gain)
+{
+    if (!srtt)
+        return 0;
+    return static_cast<uint64_t>(gain * window * 1e6 / srtt);
+}
+
+CongestionController::CongestionController()
+    : m_segment(kBaseMTU - kUDPHeaderSize)
+{
+}
+
+double CongestionController::clamp_window(double window) const
+{
+    if (window < min_window())
+        return min_window();
+    if (window > kMaxCongestionWindow)
+        return kMaxCongestionWindow;
+    return window;
+}
+
+/* Reno */
+
+RenoController::RenoController()
+{
+    reset();
+}
+
+void RenoController::reset()
+{
+    m_window = min_window();
+    m_ssthresh = kMaxCongestionWindow;
+    m_ca_acked = 0;
+}
+
+void RenoController::on_ack(uint64_t now, uint32_t bytes, uint32_t rtt, uint32_t bytes_in_flight)
+{
+    if (m_window < m_ssthresh) {
+        /* Slow start - grow by the bytes acked, at most a segment per ack */
+        m_window = static_cast<uint32_t>(clamp_window(static_cast<double>(m_window) + std::min<uint32_t>(bytes, m_segment)));
+        return;
+    }
+
+    /* Congestion avoidance - one segment per window acked */
+    m_ca_acked += bytes;
+    if (m_ca_acked >= m_window) {
+        m_ca_acked -= m_window;
+        m_window = static_cast<uint32_t>(clamp_window(static_cast<double>(m_window) + m_segment));
+    }
+}
+
+void RenoController::on_loss(uint64_t now, uint32_t bytes_in_flight)
+{
+    m_ssthresh = static_cast<uint32_t>(clamp_window(m_window / kCongestionDecFactor));
+    m_window = m_ssthresh;
+    m_ca_acked = 0;
+}
+
+uint64_t RenoController::pacing_rate(uint32_t srtt) const
+{
+    return window_rate(m_window, srtt, m_window < m_ssthresh ? kSlowStartPacingGain : kPacingGain);
+}
+
+/* CUBIC - window sizes in the growth function are in segments, time in seconds */
+
+static const double kCubicC = 0.4;
+static const double kCubicBeta = 0.7;
+
+CubicController::CubicController()
+{
+    reset();
+}
+
+void CubicController::reset()
+{
+    m_window = min_window();
+    m_ssthresh = kMaxCongestionWindow;
+    m_w_max = 0;
+    m_k = 0;
+    m_w_est = 0;
+    m_epoch_start = 0;
+    m_min_rtt = 0;
+}
+
+void CubicController::on_rtt_sample(uint64_t now, uint32_t rtt)
+{
+    if (rtt && (!m_min_rtt || rtt < m_min_rtt))
+        m_min_rtt = rtt;
+}
+
+void CubicController::on_ack(uint64_t now, uint32_t bytes, uint32_t rtt, uint32_t bytes_in_flight)
+{
+    on_rtt_sample(now, rtt);
+
+    if (m_window < m_ssthresh) {
+        m_window = clamp_window(m_window + std::min<uint32_t>(bytes, m_segment));
+        return;
+    }
+
+    double w = m_window / m_segment;
+
+    if (!m_epoch_start) {
+        /* New growth epoch - aim to get back to w_max K seconds from now */
+        m_epoch_start = now;
+        if (w < m_w_max) {
+            m_k = std::cbrt((m_w_max - w) / kCubicC);
+        }
+        else {
+            m_k = 0;
+            m_w_max = w;
+        }
+        m_w_est = w;
+    }
+
+    double t = (now + m_min_rtt - m_epoch_start) / 1e6;
+    double target = m_w_max + kCubicC * (t - m_k) * (t - m_k) * (t - m_k);
+
+    /* Never grow slower than Reno would */
+    double segments_acked = static_cast<double>(bytes) / m_segment;
+    m_w_est += 3 * (1 - kCubicBeta) / (1 + kCubicBeta) * segments_acked / w;
+    target = std::max(target, m_w_est);
+
+    /* At most 1.5x per round trip */
+    target = std::min(target, 1.5 * w);
+
+    if (target > w)
+        m_window = clamp_window(m_window + (target - w) / w * bytes);
+}
+
+void CubicController::on_loss(uint64_t now, uint32_t bytes_in_flight)
+{
+    double w = m_window / m_segment;
+
+    /* Fast convergence - release bandwidth sooner if the last epoch peaked lower */
+    if (w < m_w_max)
+        m_w_max = w * (1 + kCubicBeta) / 2;
+    else
+        m_w_max = w;
+
+    m_window = clamp_window(m_window * kCubicBeta);
+    m_ssthresh = static_cast<uint32_t>(m_window);
+    m_epoch_start = 0;
+}
+
+uint64_t CubicController::pacing_rate(uint32_t srtt) const
+{
+    return window_rate(window(), srtt, m_window < m_ssthresh ? kSlowStartPacingGain : kPacingGain);
+}
+
+/* Delivery rate - estimates the bottleneck bandwidth as the best delivery rate
+ * over the last kBandwidthRounds rounds and keeps 2 x BDP in flight. Startup
+ * grows exponentially until the bandwidth stops improving. */
+
+static const double kStartupGain = 2.885;
+static const double kWindowGain = 2.0;
+static const uint64_t kMinRttExpiry = 10 * 1000 * 1000;
+
+DeliveryRateController::DeliveryRateController()
+{
+    reset();
+}
+
+void DeliveryRateController::reset()
+{
+    m_window = min_window();
+    m_startup = true;
+    m_full_bw_rounds = 0;
+    m_full_bw = 0;
+    for (int i = 0; i < kBandwidthRounds; ++i)
+        m_bw_samples[i] = 0;
+    m_round = 0;
+    m_round_start = 0;
+    m_round_delivered = 0;
+    m_min_rtt = 0;
+    m_min_rtt_ts = 0;
+}
+
+void DeliveryRateController::on_rtt_sample(uint64_t now, uint32_t rtt)
+{
+    if (rtt && (!m_min_rtt || rtt <= m_min_rtt || now - m_min_rtt_ts > kMinRttExpiry)) {
+        m_min_rtt = rtt;
+        m_min_rtt_ts = now;
+    }
+}
+
+void DeliveryRateController::on_ack(uint64_t now, uint32_t bytes, uint32_t rtt, uint32_t bytes_in_flight)
+{
+    on_rtt_sample(now, rtt);
+
+    if (m_startup)
+        m_window = static_cast<uint32_t>(clamp_window(static_cast<double>(m_window) + bytes));
+
+    if (!m_round_start)
+        m_round_start = now;
+    m_round_delivered += bytes;
+
+    /* A round is one min RTT worth of acks */
+    if (!m_min_rtt || now - m_round_start < m_min_rtt)
+        return;
+
+    m_bw_samples[m_round % kBandwidthRounds] = m_round_delivered * 1000000 / (now - m_round_start);
+    m_round++;
+    m_round_start = now;
+    m_round_delivered = 0;
+
+    if (m_startup) {
+        uint64_t bw = *std::max_element(m_bw_samples, m_bw_samples + kBandwidthRounds);
+        if (bw >= m_full_bw + m_full_bw / 4) {
+            m_full_bw = bw;
+            m_full_bw_rounds = 0;
+        }
+        else if (++m_full_bw_rounds >= 3) {
+            m_startup = false;
+        }
+    }
+
+    update_window();
+}
+
+void DeliveryRateController::on_loss(uint64_t now, uint32_t bytes_in_flight)
+{
+    /* Loss doesn't drive the model - but it does mean the pipe is full */
+    m_startup = false;
+    update_window();
+}
+
+uint64_t DeliveryRateController::pacing_rate(uint32_t srtt) const
+{
+    /* Pace at the measured bottleneck rate - with a gain above 1 so the
+     * estimate can still rise. Until there is a sample, fall back to the window. */
+    uint64_t bw = *std::max_element(m_bw_samples, m_bw_samples + kBandwidthRounds);
+    if (!bw)
+        return window_rate(m_window, srtt, kStartupGain);
+
+    return static_cast<uint64_t>((m_startup ? kStartupGain : kPacingGain) * bw);
+}
+
+void DeliveryRateController::update_window()
+{
+    uint64_t bw = *std::max_element(m_bw_samples, m_bw_samples + kBandwidthRounds);
+    double bdp = static_cast<double>(bw) * m_min_rtt / 1e6;
+
+    if (!bw || !m_min_rtt)
+        return;
+
+    if (m_startup)
+        m_window = std::max(m_window, static_cast<uint32_t>(clamp_window(kStartupGain * bdp)));
+    else
+        m_window = static_cast<uint32_t>(clamp_window(kWindowGain * bdp));
+}
+
+} // namespace chatter
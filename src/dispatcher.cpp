@@ -0,0 +1,59 @@
+#include "chatter/dispatcher.h"
+
+namespace chatter {
+
+void Dispatcher::on_connection(EventType type, ConnectionHandler handler)
+{
+    if (type < 0 || type >= kConnectionEvents)
+        return;
+
+    m_connection_handlers[type] = handler;
+}
+
+void Dispatcher::on_packet(ProtocolChannelID channel, PacketHandler handler)
+{
+    if (channel >= kChannels)
+        return;
+
+    m_packet_handlers[channel] = handler;
+}
+
+void Dispatcher::set_executor(Executor executor)
+{
+    m_executor = executor;
+}
+
+bool Dispatcher::dispatch(EventType type, const HostAddress& address)
+{
+    if (type < 0 || type >= kConnectionEvents || !m_connection_handlers[type])
+        return false;
+
+    ConnectionHandler& handler = m_connection_handlers[type];
+
+    if (m_executor)
+        m_executor([&handler, address]() { handler(address); });
+    else
+        handler(address);
+
+    return true;
+}
+
+bool Dispatcher::dispatch_packet(const HostAddress& address, const Packet::ptr& packet)
+{
+    ProtocolChannelID channel = packet->get_channel();
+
+    if (channel >= kChannels || !m_packet_handlers[channel])
+        return false;
+
+    PacketHandler& handler = m_packet_handlers[channel];
+
+    if (m_executor)
+        /* The task holds a reference so the packet outlives the network thread's use of it */
+        m_executor([&handler, address, packet]() { handler(address, *packet); });
+    else
+        handler(address, *packet);
+
+    return true;
+}
+
+} // namespace chatter
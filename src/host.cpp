@@ -13,11 +13,17 @@ namespace chatter {
 Host::Host()
     : m_protocol(this)
 {
+    m_recv_event = platform::WakeEventCreate();
+    m_recv_space_event = platform::WakeEventCreate();
+    m_app_event = platform::WakeEventCreate();
 }
 
 Host::~Host()
 {
     shutdown();
+    platform::WakeEventDestroy(m_recv_event);
+    platform::WakeEventDestroy(m_recv_space_event);
+    platform::WakeEventDestroy(m_app_event);
 }
 
 Host::StartResult Host::start(const HostAddress& bind_address, uint16_t max_connections)
@@ -28,75 +34,300 @@ Host::StartResult Host::start(const HostAddress& bind_address, uint16_t max_conn
     if (!create_socket())
         return SOCKET_CREATE_FAILED;
 
+    if (m_parent)
+        /* Shards share the bind address */
+        platform::SocketSetOption(m_socket, SocketOption::REUSEPORT, 1);
+
+    /* Datagrams never exceed a peer's probed path MTU, so IP fragmentation is
+     * never needed - and DF is what makes an oversized probe fail */
+    platform::SocketSetOption(m_socket, SocketOption::DONT_FRAGMENT, 1);
+
     if (!platform::SocketBind(m_socket, bind_address))
         return SOCKET_BIND_FAILED;
 
     m_max_connections = max_connections > 0 ? max_connections : 1;
 
+    /* Peers are constructed in place - they hold intrusive timers and must not be copied */
     m_peers.clear();
-    m_peers.reserve(m_max_connections);
-    for (int peer_id = 0; peer_id < m_max_connections; ++peer_id) {
-        Peer p;
-        p.m_id = peer_id;
-        m_peers.push_back(p);
-    }
+    m_peers.resize(m_max_connections);
+    for (int peer_id = 0; peer_id < m_max_connections; ++peer_id)
+        m_peers[peer_id].m_id = peer_id;
+
+    m_peer_index.clear();
+    m_peer_index.reserve(m_max_connections);
+    m_free_peers.clear();
+    /* Stack order - lowest ids are handed out first */
+    for (int peer_id = m_max_connections - 1; peer_id >= 0; --peer_id)
+        m_free_peers.push_back(&m_peers[peer_id]);
 
     std::cout << "m_peers allocated: size:" << m_peers.size() << " cap:" << m_peers.capacity() << std::endl;
 
-    m_start_time = std::chrono::high_resolution_clock::now();
+    m_start_time = std::chrono::steady_clock::now();
+    update_clock();
+    m_protocol.reset(now());
+
+    /* Only THREADED mode lets the receive thread run ahead of the network
+     * thread - the other modes handle each batch as soon as it is read. A
+     * sharded parent never gets here, so it holds no slots at all. */
+    m_recv_ring.resize(m_run_mode == THREADED ? kRecvRingSize : kSocketBatchSize);
 
     m_run_threads = true;
-    m_net_worker.reset(new std::thread(&Host::net_worker, this));
-    m_net_worker->detach();
-    m_recv_worker.reset(new std::thread(&Host::recv_worker, this));
-    m_recv_worker->detach();
+
+    if (m_run_mode == EXTERNAL) {
+        /* Driven by service() */
+        platform::SocketSetOption(m_socket, SocketOption::NONBLOCK, 1);
+    }
+    else if (m_run_mode == EVENT_LOOP) {
+        platform::SocketSetOption(m_socket, SocketOption::NONBLOCK, 1);
+        m_net_worker.reset(new std::thread(&Host::loop_worker, this));
+        m_net_worker->detach();
+    }
+    else {
+        m_net_worker.reset(new std::thread(&Host::net_worker, this));
+        m_net_worker->detach();
+        m_recv_worker.reset(new std::thread(&Host::recv_worker, this));
+        m_recv_worker->detach();
+    }
 
     return START_OK;
 }
 
-Peer* Host::find_available_peer(const HostAddress& address)
+Host::StartResult Host::start(const HostAddress& bind_address, uint16_t max_connections, int shard_count)
 {
-    Peer *peer = nullptr;
+    if (shard_count <= 1)
+        return start(bind_address, max_connections);
 
-    for (std::size_t i = 0; i < m_peers.size(); ++i) {
-        if (m_peers[i].m_state  == PeerState::DISCONNECTED) {
-            peer = &m_peers[i];
-            peer->m_id = i;
-            peer->m_address = address;
-            break;
+    if (m_run_threads)
+        return ALREADY_RUNNING;
+
+    int per_shard = (max_connections + shard_count - 1) / shard_count;
+    HostAddress address = bind_address;
+
+    m_shards.clear();
+    m_shard_index.clear();
+
+    for (int i = 0; i < shard_count; ++i) {
+        std::unique_ptr<Host> shard(new Host());
+        shard->m_parent = this;
+        shard->m_run_mode = m_run_mode;
+        shard->m_congestion_algorithm = m_congestion_algorithm;
+        shard->m_packet_listener = m_packet_listener;
+        shard->m_dispatcher = m_dispatcher;
+
+        StartResult result = shard->start(address, per_shard);
+        if (result != START_OK) {
+            shutdown();
+            return result;
         }
+
+        /* An ephemeral port is chosen by the first shard - the rest join it */
+        if (address.port() == 0)
+            platform::SocketGetAddress(shard->m_socket, &address);
+
+        m_shards.push_back(std::move(shard));
     }
 
+    m_max_connections = max_connections;
+    m_run_threads = true;
+
+    return START_OK;
+}
+
+Host* Host::find_shard(const HostAddress& address)
+{
+    std::lock_guard<std::mutex> lock(m_shard_index_mutex);
+
+    auto itr = m_shard_index.find(address.key());
+    if (itr == m_shard_index.end())
+        return nullptr;
+
+    return itr->second;
+}
+
+void Host::set_shard_peer(const HostAddress& address, Host* shard)
+{
+    std::lock_guard<std::mutex> lock(m_shard_index_mutex);
+
+    if (shard)
+        m_shard_index[address.key()] = shard;
+    else
+        m_shard_index.erase(address.key());
+}
+
+Peer* Host::find_available_peer(const HostAddress& address)
+{
+    if (m_free_peers.empty())
+        return nullptr;
+
+    if (m_peer_index.count(address.key()))
+        /* One peer per address - a second would orphan the first */
+        return nullptr;
+
+    Peer* peer = m_free_peers.back();
+    m_free_peers.pop_back();
+
+    peer->m_claimed = true;
+    peer->m_address = address;
+    peer->set_congestion_control(m_congestion_algorithm);
+    m_peer_index[address.key()] = peer;
+
+    if (m_parent)
+        m_parent->set_shard_peer(address, this);
+
     return peer;
 }
 
 Peer* Host::find_peer_by_address(const HostAddress& address)
 {
-    // TODO(ben): more efficient search algorithm
-    Peer* peer = nullptr;
+    auto itr = m_peer_index.find(address.key());
+    if (itr == m_peer_index.end())
+        return nullptr;
 
-    for (auto& p : m_peers) {
-        if (p.m_address == address) {
-            peer = &p;
-            break;
-        }
+    return itr->second;
+}
+
+void Host::release_peer(Peer* peer)
+{
+    auto itr = m_peer_index.find(peer->m_address.key());
+    if (itr != m_peer_index.end() && itr->second == peer) {
+        m_peer_index.erase(itr);
+        if (m_parent)
+            m_parent->set_shard_peer(peer->m_address, nullptr);
     }
 
-    return peer;
+    peer->reset();
+
+    /* The slot goes back whatever the index says, but only once */
+    if (peer->m_claimed) {
+        peer->m_claimed = false;
+        m_free_peers.push_back(peer);
+    }
 }
 
 bool Host::connect(const HostAddress& address)
 {
-    Peer* peer = find_available_peer(address);
+    if (!m_run_threads)
+        return false;
 
-    if (!peer)
+    if (!m_shards.empty())
+        /* The reply could be steered to any shard */
         return false;
 
-    return m_protocol.connect(peer);
+    {
+        std::lock_guard<std::mutex> lock(m_app_requests_mutex);
+        m_app_requests.push_back({AppRequest::CONNECT, address, nullptr});
+    }
+    wake();
+
+    return true;
+}
+
+void Host::set_run_mode(RunMode mode)
+{
+    if (!m_run_threads)
+        m_run_mode = mode;
+}
+
+void Host::set_congestion_control(CongestionAlgorithm algorithm)
+{
+    if (!m_run_threads)
+        m_congestion_algorithm = algorithm;
+}
+
+void Host::set_congestion_control(const HostAddress& address, CongestionAlgorithm algorithm)
+{
+    if (!m_shards.empty()) {
+        Host* shard = find_shard(address);
+        if (shard)
+            shard->set_congestion_control(address, algorithm);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_app_requests_mutex);
+        AppRequest request = {AppRequest::CONGESTION, address, nullptr};
+        request.algorithm = algorithm;
+        m_app_requests.push_back(request);
+    }
+    wake();
+}
+
+void Host::wake()
+{
+    /* Threaded mode picks requests up on its next pass. The event loop
+     * sleeps until there is work - one signal covers every request queued
+     * before it runs. service() only needs to know not to wait. */
+    if (m_run_mode == THREADED)
+        return;
+
+    if (!m_app_wake_pending.exchange(true) && m_run_mode == EVENT_LOOP)
+        platform::WakeEventSignal(m_app_event);
+}
+
+std::size_t Host::service(int timeout_ms /* = 0 */)
+{
+    if (!m_run_threads || m_run_mode != EXTERNAL)
+        return 0;
+
+    if (!m_shards.empty()) {
+        std::size_t received = 0;
+        for (auto& shard : m_shards)
+            received += shard->service(0);
+        return received;
+    }
+
+    if (timeout_ms != 0) {
+        /* Don't sleep through protocol work or requests already made */
+        uint64_t deadline = m_protocol.next_deadline();
+        if (deadline != UINT64_MAX) {
+            uint64_t now = timestamp_now();
+            /* Rounded up to whole milliseconds so we don't wake just short of it */
+            uint64_t until = deadline > now ? (deadline - now + 999) / 1000 : 0;
+            if (timeout_ms < 0 || until < static_cast<uint64_t>(timeout_ms))
+                timeout_ms = static_cast<int>(until);
+        }
+        if (m_app_wake_pending.load())
+            timeout_ms = 0;
+
+        if (timeout_ms != 0)
+            platform::SocketWaitReadable(m_socket, timeout_ms);
+    }
+
+    m_app_wake_pending.store(false);
+
+    std::size_t received = drain_socket();
+    service_network();
+
+    return received;
+}
+
+uint64_t Host::next_deadline()
+{
+    if (!m_shards.empty()) {
+        /* Shards run on their own clocks - report the soonest in ours */
+        uint64_t earliest = UINT64_MAX;
+        uint64_t now = timestamp_now();
+        for (auto& shard : m_shards) {
+            uint64_t deadline = shard->next_deadline();
+            if (deadline == UINT64_MAX)
+                continue;
+            uint64_t shard_now = shard->timestamp_now();
+            uint64_t local = now + (deadline > shard_now ? deadline - shard_now : 0);
+            if (local < earliest)
+                earliest = local;
+        }
+        return earliest;
+    }
+
+    return m_protocol.next_deadline();
 }
 
 void Host::shutdown()
 {
+    /* Shards are kept until destruction - their workers are detached */
+    for (auto& shard : m_shards)
+        shard->shutdown();
+
     for (auto &peer : m_peers) {
         if (peer.m_state == PeerState::CONNECTED) {
             m_protocol.disconnect(&peer);
@@ -105,6 +336,13 @@ void Host::shutdown()
     }
 
     m_run_threads = false;
+    if (m_run_mode == EVENT_LOOP)
+        platform::WakeEventSignal(m_app_event);
+
+    m_peer_index.clear();
+    m_free_peers.clear();
+    m_send_queue.clear();
+    m_send_due.clear();
     m_peers.clear();
 
     /* TODO(ben): Wait for network thread to stop? */
@@ -118,9 +356,14 @@ bool Host::is_active()
 
 uint64_t Host::timestamp_now()
 {
-    auto now = std::chrono::high_resolution_clock::now();
-    auto int_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_start_time);
-    return int_ms.count();
+    auto now = std::chrono::steady_clock::now();
+    auto int_us = std::chrono::duration_cast<std::chrono::microseconds>(now - m_start_time);
+    return int_us.count();
+}
+
+void Host::update_clock()
+{
+    m_now = timestamp_now();
 }
 
 bool Host::create_socket()
@@ -160,6 +403,10 @@ void Host::receive_message(const RecvMsg& msg)
         return;
 
     m_protocol.handle_message(peer, msg.msg, msg.msg_size);
+
+    if (peer->m_state == PeerState::DISCONNECTED)
+        /* Message didn't start a connection - give the slot back */
+        release_peer(peer);
 }
 
 void Host::queue_outgoing_packet(const Packet::ptr packet, bool immediate /* = false */)
@@ -167,123 +414,447 @@ void Host::queue_outgoing_packet(const Packet::ptr packet, bool immediate /* = f
     if (!packet)
         return;
 
-    if (!immediate) {
-        std::lock_guard<std::mutex> lock(m_send_queue_mutex);
-        m_send_queue.push_back(packet);
-    }
-    else {
+    if (immediate) {
         send_packet_internal(packet);
+        return;
     }
+
+    if (!packet->is_type(PacketType::USER_DATA)) {
+        /* Protocol packets (acks etc) are never held back */
+        m_send_queue.push_back(packet);
+        return;
+    }
+
+    packet->m_peer->m_send_queue.push_back(packet);
+    mark_send_due(packet->m_peer);
+}
+
+void Host::mark_send_due(Peer* peer)
+{
+    if (peer->m_send_due || peer->m_send_queue.empty())
+        return;
+
+    peer->m_send_due = true;
+    m_send_due.push_back(peer);
 }
 
 void Host::net_worker()
 {
     while (m_run_threads) {
-        /* Service recv queue */
-        {
-            std::unique_lock<std::mutex> lock(m_recv_queue_mutex);
-            m_recv_queue_cv.wait_for(
-                    lock,
-                    std::chrono::milliseconds(10),
-                    [&](){return m_recv_queue.size();});
+        /* Service recv ring */
+        if (!m_recv_ring.readable()) {
+            /* Announce the sleep before re-checking, so a datagram published
+             * in between is guaranteed to signal us */
+            m_recv_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (!m_recv_ring.readable()) {
+                /* Sleep no later than the next protocol deadline, so paced
+                 * sends and timers keep their resolution */
+                int64_t timeout = kNetWorkerWait;
+                uint64_t deadline = m_protocol.next_deadline();
+                uint64_t now = timestamp_now();
+                if (deadline < now + kNetWorkerWait)
+                    timeout = deadline > now ? deadline - now : 0;
+                platform::WakeEventWait(m_recv_event, timeout);
+            }
 
+            m_recv_waiting.store(false, std::memory_order_relaxed);
+        }
 
-            for (auto& msg : m_recv_queue)
-                receive_message(msg);
+        handle_received();
+        service_network();
+    }
+}
 
-            m_recv_queue.clear();
-        }
+void Host::loop_worker()
+{
+    Poller poller = platform::PollerCreate();
+    DeadlineTimer timer = platform::DeadlineTimerCreate();
 
-        /* Service send queue */
-        {
-            std::lock_guard<std::mutex> lock(m_send_queue_mutex);
-            auto itr = m_send_queue.begin();
-            Packet::ptr p = nullptr;
-            while (itr != m_send_queue.end()) {
-                p = *itr;
-                if (!p->m_peer->congestion_window_full()) {
-                    send_packet_internal(p);
-                    itr = m_send_queue.erase(itr);
-                }
-                else {
-                    ++itr;
-                }
+    platform::PollerAdd(poller, m_socket);
+    platform::PollerAdd(poller, m_app_event);
+    platform::PollerAdd(poller, timer);
+
+    while (m_run_threads) {
+        /* Sleep until a datagram arrives, the application queues a request or
+         * the next protocol deadline passes */
+        int ready[3];
+        int count = platform::PollerWait(poller, ready, 3, -1);
+
+        bool readable = false;
+        for (int i = 0; i < count; ++i) {
+            if (ready[i] == m_socket) {
+                readable = true;
+            }
+            else if (ready[i] == m_app_event) {
+                m_app_wake_pending.store(false);
+                platform::WakeEventWait(m_app_event, 0);
+            }
+            else if (ready[i] == timer) {
+                platform::DeadlineTimerConsume(timer);
             }
         }
 
-        /* Protocol periodic stuff */
-        for (int peer_id = 0; peer_id < m_max_connections; peer_id++) {
-            if (m_peers[peer_id].m_state != PeerState::DISCONNECTED)
-                m_protocol.update(&m_peers[peer_id], timestamp_now());
+        if (readable)
+            drain_socket();
+
+        service_network();
+
+        uint64_t deadline = m_protocol.next_deadline();
+        if (deadline == UINT64_MAX) {
+            platform::DeadlineTimerDisarm(timer);
+        }
+        else {
+            uint64_t now = timestamp_now();
+            platform::DeadlineTimerArm(timer, deadline > now ? deadline - now : 0);
         }
     }
+
+    platform::DeadlineTimerDestroy(timer);
+    platform::PollerDestroy(poller);
+}
+
+std::size_t Host::drain_socket()
+{
+    /* Bounded so timers and sends still get a turn under load - the
+     * socket stays readable and we come straight back */
+    std::size_t received = 0;
+    while (received < kRecvRingSize) {
+        int n = recv_batch();
+        if (n <= 0)
+            break;
+        handle_received();
+        received += n;
+    }
+
+    return received;
+}
+
+int Host::recv_batch()
+{
+    Datagram datagrams[kSocketBatchSize];
+    std::size_t count = m_recv_ring.writable();
+
+    if (count > kSocketBatchSize)
+        count = kSocketBatchSize;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        RecvMsg& slot = m_recv_ring.write_slot(i);
+        datagrams[i].buf = slot.msg;
+        datagrams[i].buf_len = sizeof(slot.msg);
+    }
+
+    /* Receive packets! Blocks until at least one datagram is available, unless
+     * the socket is nonblocking */
+    int received = count ? platform::SocketRecvBatch(m_socket, datagrams, count) : 0;
+
+    for (int i = 0; i < received; ++i) {
+        RecvMsg& slot = m_recv_ring.write_slot(i);
+        slot.msg_size = datagrams[i].msg_len;
+        slot.address = datagrams[i].address;
+    }
+
+    if (received > 0)
+        m_recv_ring.publish(received);
+
+    return received;
+}
+
+void Host::handle_received()
+{
+    std::size_t recv_count = m_recv_ring.readable();
+    if (!recv_count)
+        return;
+
+    /* One clock sample covers the whole batch */
+    update_clock();
+
+    for (std::size_t i = 0; i < recv_count; ++i) {
+        receive_message(m_recv_ring.read_slot(0));
+        /* Hand each slot back straight away so the recv thread never waits on the batch */
+        m_recv_ring.release(1);
+    }
+
+    /* Pairs with the fence in recv_worker - only wake it if it is sleeping on a full ring */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_recv_full.load(std::memory_order_relaxed))
+        platform::WakeEventSignal(m_recv_space_event);
+}
+
+void Host::service_network()
+{
+    update_clock();
+
+    /* Carry out connects and sends requested by the application */
+    service_app_requests();
+
+    /* Protocol periodic stuff - timeouts, pings, delayed acks and resends */
+    m_protocol.service_timers(now());
+
+    /* Service send queue */
+    for (auto& p : m_send_queue)
+        batch_packet(p);
+    m_send_queue.clear();
+
+    /* User data - only peers that may be able to send since the last pass.
+     * Peers marked while sending wait for the next one. */
+    m_send_due.swap(m_send_due_swap);
+    for (Peer* peer : m_send_due_swap) {
+        peer->m_send_due = false;
+        service_peer_sends(peer);
+    }
+    m_send_due_swap.clear();
+
+    flush_send_batch();
+}
+
+void Host::service_peer_sends(Peer* peer)
+{
+    auto itr = peer->m_send_queue.begin();
+    while (itr != peer->m_send_queue.end()) {
+        const Packet::ptr& p = *itr;
+
+        /* Resends aren't held back by the congestion window - their bytes
+         * are already counted in it. First sends also wait for room in
+         * the receiver's window, held back per channel. The peer is marked
+         * due again when an ack opens either window. */
+        if (p->m_send_count == 0 && (peer->congestion_window_full() || !peer->receive_window_open(p))) {
+            ++itr;
+            continue;
+        }
+
+        /* User data is paced, so a window's worth doesn't leave in one burst.
+         * The pacing timer marks the peer due again. */
+        if (!peer->pacing_ready(now())) {
+            m_protocol.schedule_pacing(peer);
+            return;
+        }
+
+        peer->pacing_sent(now(), p->raw_len());
+        batch_packet(p);
+        itr = peer->m_send_queue.erase(itr);
+    }
+}
+
+void Host::service_app_requests()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_app_requests_mutex);
+        m_app_requests.swap(m_app_requests_swap);
+    }
+
+    for (auto& request : m_app_requests_swap) {
+        switch (request.type) {
+            case AppRequest::CONNECT:
+                {
+                    Peer* peer = find_available_peer(request.address);
+                    if (!peer || !m_protocol.connect(peer)) {
+                        post_event(EventType::PEER_UNABLE_TO_CONNECT, request.address);
+                    }
+                }
+                break;
+
+            case AppRequest::CONGESTION:
+                {
+                    Peer* peer = find_peer_by_address(request.address);
+                    if (peer) {
+                        peer->set_congestion_control(request.algorithm);
+                        mark_send_due(peer);
+                    }
+                }
+                break;
+
+            case AppRequest::SEND:
+                request.packet->m_peer = find_peer_by_address(request.address);
+                if (request.packet->m_peer)
+                    m_protocol.send(request.packet);
+                else
+                    post_not_delivered(request.address, request.packet);
+                break;
+        }
+    }
+
+    m_app_requests_swap.clear();
 }
 
 void Host::recv_worker()
 {
     while (m_run_threads) {
-        /* Receive packets! */
-        RecvMsg msg;
+        if (!m_recv_ring.writable()) {
+            /* net_worker has fallen behind - leave datagrams queued in the
+             * socket buffer and sleep until it frees some slots. Announce
+             * the sleep before re-checking, as net_worker does. */
+            m_recv_full.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (!m_recv_ring.writable())
+                platform::WakeEventWait(m_recv_space_event, kNetWorkerWait);
+
+            m_recv_full.store(false, std::memory_order_relaxed);
+            continue;
+        }
 
-        /* Blocking recvfrom */
-        msg.msg_size = platform::SocketRecvFrom(m_socket, (void*)&msg.msg, kMaxUDPPayloadSize, &msg.address);
+        if (recv_batch() <= 0)
+            continue;
 
-        if (msg.msg_size > 0) {
-            {
-                std::lock_guard<std::mutex> lock(m_recv_queue_mutex);
-                m_recv_queue.push_back(msg);
-            }
-            m_recv_queue_cv.notify_one();
-        }
+        /* Pairs with the fence in net_worker - only pay for the wakeup when it sleeps */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_recv_waiting.load(std::memory_order_relaxed))
+            platform::WakeEventSignal(m_recv_event);
     }
 }
 
-void Host::send_packet_internal(const Packet::ptr packet)
+bool Host::prepare_packet_send(const Packet::ptr packet)
 {
     if (!packet->m_peer)
         /* TODO(ben): Generate error - no destination */
-        return;
+        return false;
 
     if (packet->m_peer->m_state == PeerState::DISCONNECTED)
-        return;
-
-    uint8_t buf[kMaxUDPPayloadSize];
-    std::size_t raw_len = packet->read_raw(buf, kMaxUDPPayloadSize);
+        return false;
 
-    packet->m_last_send_time = timestamp_now();
+    packet->m_last_send_time = now();
     packet->m_send_count++;
+    m_protocol.packet_sent(packet);
 
     if (packet->has_flag(PacketFlag::RELIABLE)) {
-        /* Reliable packets contribute to congestion control */
-        packet->m_peer->m_bytes_on_wire += packet->data_len();
+        /* Reliable packets contribute to congestion control. A resend is
+         * still the same bytes in flight - only the first send counts. */
+        if (packet->m_send_count == 1)
+            packet->m_peer->m_bytes_on_wire += packet->data_len();
+        packet->m_peer->m_congestion->on_send(now(), packet->data_len(), packet->m_peer->m_bytes_on_wire);
     }
 
     if (m_packet_listener) {
         PacketStats packet_s;
         PeerStats peer_s;
         build_packet_stats(packet, packet_s, peer_s);
-        m_packet_listener->on_send(timestamp_now(), packet_s, peer_s);
+        m_packet_listener->on_send(now(), packet_s, peer_s);
     }
 
     packet->m_send_queued = false;
 
-    if (raw_len)
-        platform::SocketSendTo(m_socket, buf, raw_len, packet->m_peer->m_address);
+    return true;
+}
+
+void Host::send_packet_internal(const Packet::ptr packet)
+{
+    if (!prepare_packet_send(packet))
+        return;
+
+    /* Header is written into the packet's headroom, so the frame goes out
+     * straight from packet storage */
+    std::size_t raw_len = packet->serialize();
+    platform::SocketSendTo(m_socket, packet->wire(), raw_len, packet->m_peer->m_address);
+}
+
+void Host::batch_packet(const Packet::ptr packet)
+{
+    std::size_t raw_len = packet->raw_len();
+
+    Peer* peer = packet->m_peer;
+    if (!peer)
+        return;
+
+    if (raw_len > peer->max_datagram()) {
+        if (packet->has_flag(PacketFlag::RELIABLE))
+            /* Built for a larger MTU than the path now carries */
+            send_split(packet);
+        else
+            /* Too large to share a datagram - MTU probes */
+            send_packet_internal(packet);
+        return;
+    }
+
+    /* Only take a batch slot for a packet that is really going out, so a
+     * failed send never leaves an empty datagram behind */
+    if (!prepare_packet_send(packet))
+        return;
+
+    /* Coalesce into the datagram already open for this peer if it has room,
+     * otherwise open a new one */
+    raw_len = packet->serialize();
+    if (peer->m_batch_slot < 0 ||
+            m_send_batch[peer->m_batch_slot].msg_len + raw_len > peer->max_datagram() ||
+            m_send_batch[peer->m_batch_slot].segment_count == kMaxDatagramSegments) {
+        if (m_send_batch_count == kSocketBatchSize)
+            flush_send_batch();
+
+        peer->m_batch_slot = m_send_batch_count++;
+        m_send_batch_peers[peer->m_batch_slot] = peer;
+
+        Datagram& d = m_send_batch[peer->m_batch_slot];
+        d.buf = nullptr;
+        d.msg_len = 0;
+        d.address = peer->m_address;
+        d.segments = m_send_segments[peer->m_batch_slot];
+        d.segment_count = 0;
+    }
+
+    /* Reference the serialized frame in place - the packet is held until the
+     * batch is flushed so the segment stays valid */
+    Datagram& d = m_send_batch[peer->m_batch_slot];
+    m_send_segments[peer->m_batch_slot][d.segment_count++] = DatagramSegment{packet->wire(), raw_len};
+    d.msg_len += raw_len;
+    m_send_batch_packets.push_back(packet);
+}
+
+void Host::send_split(const Packet::ptr packet)
+{
+    if (!prepare_packet_send(packet))
+        return;
+
+    /* The serialized frame, sequence number and all, goes out in equal
+     * pieces bar the last. They are unreliable - if any is lost the packet
+     * times out and is split again. */
+    Peer* peer = packet->m_peer;
+    std::size_t raw_len = packet->serialize();
+    std::size_t max_piece = peer->max_datagram() - Packet::kFrameHeaderLen - Packet::kSplitHeaderLen;
+    std::size_t count = (raw_len + max_piece - 1) / max_piece;
+    std::size_t size = (raw_len + count - 1) / count;
+    uint16_t id = peer->m_split_id++;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        auto piece = Packet::create();
+        piece->set_type(PacketType::PROTO_SPLIT);
+        piece->m_peer = peer;
+        piece->write(id);
+        piece->write(static_cast<uint8_t>(i));
+        piece->write(static_cast<uint8_t>(count));
+        piece->write(static_cast<uint16_t>(raw_len));
+        piece->append_bytes(packet->wire() + i * size, std::min(size, raw_len - i * size));
+        batch_packet(piece);
+    }
+}
+
+void Host::flush_send_batch()
+{
+    std::size_t sent = 0;
+
+    while (sent < m_send_batch_count) {
+        int ret = platform::SocketSendBatch(m_socket, &m_send_batch[sent], m_send_batch_count - sent);
+        if (ret <= 0)
+            /* Drop the datagram that failed and carry on with the rest */
+            sent++;
+        else
+            sent += ret;
+    }
+
+    for (std::size_t i = 0; i < m_send_batch_count; ++i)
+        m_send_batch_peers[i]->m_batch_slot = -1;
+
+    m_send_batch_count = 0;
+    m_send_batch_packets.clear();
 }
 
 Event::ptr Host::get_event()
 {
     Event::ptr ret;
 
-    std::lock_guard<std::mutex> lock(m_event_queue_mutex);
-    if (m_event_queue.empty())
+    if (!m_event_queue.pop(ret))
         ret = nullptr;
 
-    else {
-        ret = m_event_queue.front();
-        m_event_queue.pop();
-    }
-
     return ret;
 }
 
@@ -292,19 +863,55 @@ void Host::send(const HostAddress& address, Packet::ptr packet)
     if (!packet)
         return;
 
-    packet->m_peer = find_peer_by_address(address);
+    if (!m_shards.empty()) {
+        /* Hand over to the shard that owns the peer */
+        Host* shard = find_shard(address);
 
-    if (!packet->m_peer)
+        if (shard)
+            shard->send(address, packet);
+        else
+            post_not_delivered(address, packet);
         return;
+    }
+
     /* TODO(ben): function should allow returning error */
+    {
+        std::lock_guard<std::mutex> lock(m_app_requests_mutex);
+        m_app_requests.push_back({AppRequest::SEND, address, packet});
+    }
+    wake();
+}
+
+void Host::post_event(EventType type, const HostAddress& address, const Packet::ptr& packet /* = nullptr */)
+{
+    if (m_dispatcher) {
+        bool handled = (type == EventType::PACKET_RECEIVED) ?
+            m_dispatcher->dispatch_packet(address, packet) :
+            m_dispatcher->dispatch(type, address);
 
-    m_protocol.send(packet);
+        if (handled)
+            return;
+    }
+
+    auto e = Event::create(type);
+    e->address = address;
+    e->packet = packet;
+
+    /* Shards deliver through the parent's queue so the application sees one host */
+    if (m_parent)
+        m_parent->m_event_queue.push(e);
+    else
+        m_event_queue.push(e);
 }
 
-void Host::queue_event(const Event::ptr event)
+void Host::post_not_delivered(const HostAddress& address, const Packet::ptr& packet)
 {
-    std::lock_guard<std::mutex> lock(m_event_queue_mutex);
-    m_event_queue.push(event);
+    post_event(EventType::PACKET_NOT_DELIVERED, address, packet);
+}
+
+void Host::set_dispatcher(Dispatcher* dispatcher)
+{
+    m_dispatcher = dispatcher;
 }
 
 void Host::register_packet_listener(PacketListener* listener)
@@ -327,12 +934,16 @@ void Host::build_packet_stats(Packet::ptr packet, PacketStats &packet_s, PeerSta
     packet_s.sequenced = packet->has_flag(PacketFlag::SEQUENCED);
     packet_s.timestamped = packet->has_flag(PacketFlag::TIMESTAMPED);
     if (packet_s.type == PacketType::PROTO_ACK) {
+        /* Report the first ack block (channel and cumulative ack) */
+        uint8_t block_count = 0;
+        packet_s.channel = kReliableUnorderedChannel;
+        packet_s.sequence_number = 0;
         packet->m_read_pos = 0;
-        packet->read(packet_s.sequence_number);
-        if (packet->has_more_data())
+        packet->read(block_count);
+        if (block_count) {
             packet->read(packet_s.channel);
-        else
-            packet_s.channel = 32;
+            packet->read(packet_s.sequence_number);
+        }
         packet->m_read_pos = 0;
     }
     else {
@@ -350,7 +961,10 @@ void Host::build_packet_stats(Packet::ptr packet, PacketStats &packet_s, PeerSta
     peer_s.connect_time = peer->m_connect_ts;
     peer_s.rtt_avg = peer->m_rtt_avg;
     peer_s.rtt_dev = peer->m_rtt_dev;
-    peer_s.congestion_window = peer->m_congestion_window;
+    peer_s.clock_offset = peer->m_clock_offset;
+    peer_s.congestion_window = peer->m_congestion->window();
+    peer_s.mtu = peer->m_mtu;
+    peer_s.pacing_rate = peer->m_congestion->pacing_rate(peer->m_rtt_avg);
     peer_s.bytes_on_wire = peer->m_bytes_on_wire;
 }
 
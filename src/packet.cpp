@@ -9,17 +9,21 @@
 namespace chatter {
 
 Packet::Packet(int flags /* = 0 */, ProtocolChannelID channel /* = 0 */)
+    : m_buffer(kHeaderRoom)
 {
     set_type(PacketType::USER_DATA);
     set_flag(static_cast<PacketFlag>(flags));
     if (channel > 31)
         channel = 31;
     set_channel(channel);
+
+    m_resend_timer.type = TimerType::PACKET_RESEND;
+    m_resend_timer.owner = this;
 }
 
 Packet::ptr Packet::create(int flags /* = 0 */, ProtocolChannelID channel /* = 0 */)
 {
-    return std::make_shared<Packet>(flags, channel);
+    return std::allocate_shared<Packet>(PacketPool<Packet>(), flags, channel);
 }
 
 bool Packet::has_flag(PacketFlag flag)
@@ -29,11 +33,18 @@ bool Packet::has_flag(PacketFlag flag)
 
 ProtocolChannelID Packet::get_channel()
 {
-    if (has_flag(PacketFlag::ORDERED))
+    /* Unreliable sequenced packets use the channel's own sequence numbers, so
+     * they get the channel too - reliable ones only when ordered */
+    if (has_flag(PacketFlag::ORDERED) || (has_flag(PacketFlag::SEQUENCED) && !has_flag(PacketFlag::RELIABLE)))
         return static_cast<ProtocolChannelID>((m_cmd & kPacketChanMask) >> kPacketChanShift);
     return kReliableUnorderedChannel;
 }
 
+bool Packet::has_sequence()
+{
+    return has_flag(PacketFlag::RELIABLE) || has_flag(PacketFlag::SEQUENCED);
+}
+
 void Packet::set_channel(ProtocolChannelID chan)
 {
     if (chan > 31)
@@ -44,6 +55,7 @@ void Packet::set_channel(ProtocolChannelID chan)
 
     /* Set the field */
     m_cmd |= static_cast<uint16_t>(chan) << kPacketChanShift;
+    m_wire_len = 0;
 }
 
 void Packet::append_bytes(const void* data, std::size_t data_len)
@@ -51,14 +63,42 @@ void Packet::append_bytes(const void* data, std::size_t data_len)
     if (!data || data_len <= 0)
         return;
 
-    std::size_t start = m_data.size();
-    m_data.resize(start + data_len);
-    std::memcpy(&m_data[start], data, data_len);
+    std::size_t start = m_buffer.size();
+    m_buffer.resize(start + data_len);
+    std::memcpy(&m_buffer[start], data, data_len);
+    m_write_bit = 0;
+    m_wire_len = 0;
+}
+
+void Packet::set_payload(const void* data, std::size_t data_len)
+{
+    m_buffer.resize(kHeaderRoom);
+    m_read_pos = 0;
+    m_read_bit = 0;
+    m_write_bit = 0;
+    append_bytes(data, data_len);
+}
+
+void Packet::resize_payload(std::size_t data_len)
+{
+    m_buffer.resize(kHeaderRoom + data_len);
+    m_write_bit = 0;
+    m_wire_len = 0;
 }
 
 bool Packet::check_bounds(std::size_t data_len)
 {
-    return m_read_pos + data_len <= m_data.size();
+    align_read();
+    return m_read_pos + data_len <= this->data_len();
+}
+
+void Packet::align_read()
+{
+    /* Skip the unread (padding) bits of a partly read byte */
+    if (m_read_bit) {
+        m_read_pos++;
+        m_read_bit = 0;
+    }
 }
 
 void Packet::write(bool data)
@@ -123,105 +163,314 @@ void Packet::write(double data)
     append_bytes(&data, sizeof(data));
 }
 
-void Packet::read(bool& data)
+bool Packet::read(bool& data)
 {
     uint8_t val;
     if (!check_bounds(sizeof(val)))
-        return;
+        return false;
 
-    val = *reinterpret_cast<const uint8_t*>(&m_data[m_read_pos]);
+    val = *reinterpret_cast<const uint8_t*>(this->data() + m_read_pos);
     m_read_pos += sizeof(val);
     data = (val == true);
+    return true;
 }
 
-void Packet::read(uint8_t& data)
+bool Packet::read(uint8_t& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = *reinterpret_cast<const uint8_t*>(&m_data[m_read_pos]);
+    data = *reinterpret_cast<const uint8_t*>(this->data() + m_read_pos);
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(int8_t& data)
+bool Packet::read(int8_t& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = *reinterpret_cast<const int8_t*>(&m_data[m_read_pos]);
+    data = *reinterpret_cast<const int8_t*>(this->data() + m_read_pos);
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(uint16_t& data)
+bool Packet::read(uint16_t& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = platform::NetToHost16(*reinterpret_cast<const uint16_t*>(&m_data[m_read_pos]));
+    data = platform::NetToHost16(*reinterpret_cast<const uint16_t*>(this->data() + m_read_pos));
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(int16_t& data)
+bool Packet::read(int16_t& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = platform::NetToHost16(*reinterpret_cast<const int16_t*>(&m_data[m_read_pos]));
+    data = platform::NetToHost16(*reinterpret_cast<const int16_t*>(this->data() + m_read_pos));
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(uint32_t& data)
+bool Packet::read(uint32_t& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = platform::NetToHost32(*reinterpret_cast<const uint32_t*>(&m_data[m_read_pos]));
+    data = platform::NetToHost32(*reinterpret_cast<const uint32_t*>(this->data() + m_read_pos));
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(int32_t& data)
+bool Packet::read(int32_t& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = platform::NetToHost32(*reinterpret_cast<const int32_t*>(&m_data[m_read_pos]));
+    data = platform::NetToHost32(*reinterpret_cast<const int32_t*>(this->data() + m_read_pos));
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(uint64_t& data)
+bool Packet::read(uint64_t& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = platform::NetToHost64(*reinterpret_cast<const uint64_t*>(&m_data[m_read_pos]));
+    data = platform::NetToHost64(*reinterpret_cast<const uint64_t*>(this->data() + m_read_pos));
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(int64_t& data)
+bool Packet::read(int64_t& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = platform::NetToHost64(*reinterpret_cast<const int64_t*>(&m_data[m_read_pos]));
+    data = platform::NetToHost64(*reinterpret_cast<const int64_t*>(this->data() + m_read_pos));
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(float& data)
+bool Packet::read(float& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = *reinterpret_cast<const float*>(&m_data[m_read_pos]);
+    data = *reinterpret_cast<const float*>(this->data() + m_read_pos);
     m_read_pos += sizeof(data);
+    return true;
 }
 
-void Packet::read(double& data)
+bool Packet::read(double& data)
 {
     if (!check_bounds(sizeof(data)))
-        return;
+        return false;
 
-    data = *reinterpret_cast<const double*>(&m_data[m_read_pos]);
+    data = *reinterpret_cast<const double*>(this->data() + m_read_pos);
     m_read_pos += sizeof(data);
+    return true;
+}
+
+static int bits_required(uint32_t range)
+{
+    int bits = 0;
+    while (bits < 32 && (range >> bits))
+        bits++;
+    return bits;
+}
+
+void Packet::write_bits(uint32_t value, int nbits)
+{
+    if (nbits <= 0)
+        return;
+    if (nbits < 32)
+        value &= (static_cast<uint32_t>(1) << nbits) - 1;
+
+    while (nbits > 0) {
+        if (!m_write_bit)
+            m_buffer.push_back(0);
+
+        int take = 8 - m_write_bit;
+        if (take > nbits)
+            take = nbits;
+
+        m_buffer.back() |= static_cast<uint8_t>(value << m_write_bit);
+        value >>= take;
+        nbits -= take;
+        m_write_bit = (m_write_bit + take) & 7;
+    }
+
+    m_wire_len = 0;
+}
+
+void Packet::write_ranged(int32_t value, int32_t min, int32_t max)
+{
+    if (max < min)
+        return;
+    if (value < min)
+        value = min;
+    if (value > max)
+        value = max;
+
+    uint32_t range = static_cast<uint32_t>(max) - static_cast<uint32_t>(min);
+    write_bits(static_cast<uint32_t>(value) - static_cast<uint32_t>(min), bits_required(range));
+}
+
+void Packet::write_quantized(float value, float min, float max, int nbits)
+{
+    if (nbits <= 0 || nbits > 32 || !(max > min))
+        return;
+    if (!(value >= min))
+        value = min;
+    if (value > max)
+        value = max;
+
+    uint32_t steps = nbits == 32 ? UINT32_MAX : (static_cast<uint32_t>(1) << nbits) - 1;
+    double normal = (static_cast<double>(value) - min) / (static_cast<double>(max) - min);
+    write_bits(static_cast<uint32_t>(normal * steps + 0.5), nbits);
+}
+
+void Packet::write_varint(uint64_t value)
+{
+    uint8_t buf[10];
+    std::size_t len = 0;
+
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value)
+            byte |= 0x80;
+        buf[len++] = byte;
+    } while (value);
+
+    append_bytes(buf, len);
+}
+
+void Packet::write_zigzag(int64_t value)
+{
+    uint64_t bits = static_cast<uint64_t>(value);
+    write_varint((bits << 1) ^ (value < 0 ? UINT64_MAX : 0));
+}
+
+bool Packet::read_bits(uint32_t& value, int nbits)
+{
+    if (nbits <= 0 || nbits > 32)
+        return false;
+
+    if (m_read_pos >= data_len())
+        return false;
+    if ((data_len() - m_read_pos) * 8 - m_read_bit < static_cast<std::size_t>(nbits))
+        return false;
+
+    uint64_t result = 0;
+    int got = 0;
+
+    while (got < nbits) {
+        int take = 8 - m_read_bit;
+        if (take > nbits - got)
+            take = nbits - got;
+
+        uint64_t bits = (data()[m_read_pos] >> m_read_bit) & ((1 << take) - 1);
+        result |= bits << got;
+        got += take;
+
+        m_read_bit += take;
+        if (m_read_bit == 8) {
+            m_read_pos++;
+            m_read_bit = 0;
+        }
+    }
+
+    value = static_cast<uint32_t>(result);
+    return true;
+}
+
+bool Packet::read_ranged(int32_t& value, int32_t min, int32_t max)
+{
+    if (max < min)
+        return false;
+
+    std::size_t pos = m_read_pos;
+    int bit = m_read_bit;
+    uint32_t range = static_cast<uint32_t>(max) - static_cast<uint32_t>(min);
+    uint32_t offset;
+
+    /* A single value range takes no bits */
+    if (!range) {
+        value = min;
+        return true;
+    }
+
+    if (!read_bits(offset, bits_required(range)))
+        return false;
+
+    if (offset > range) {
+        m_read_pos = pos;
+        m_read_bit = bit;
+        return false;
+    }
+
+    value = static_cast<int32_t>(static_cast<uint32_t>(min) + offset);
+    return true;
+}
+
+bool Packet::read_quantized(float& value, float min, float max, int nbits)
+{
+    if (nbits <= 0 || nbits > 32 || !(max > min))
+        return false;
+
+    uint32_t quantized;
+    if (!read_bits(quantized, nbits))
+        return false;
+
+    uint32_t steps = nbits == 32 ? UINT32_MAX : (static_cast<uint32_t>(1) << nbits) - 1;
+    value = static_cast<float>(min + (static_cast<double>(max) - min) * quantized / steps);
+    return true;
+}
+
+bool Packet::read_varint(uint64_t& value)
+{
+    std::size_t pos = m_read_pos;
+    int bit = m_read_bit;
+    uint64_t result = 0;
+
+    align_read();
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (m_read_pos >= data_len())
+            break;
+
+        uint8_t byte = data()[m_read_pos++];
+
+        /* The tenth byte may only carry the top bit */
+        if (shift == 63 && byte > 1)
+            break;
+
+        result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            value = result;
+            return true;
+        }
+    }
+
+    /* Truncated or overlong */
+    m_read_pos = pos;
+    m_read_bit = bit;
+    return false;
+}
+
+bool Packet::read_zigzag(int64_t& value)
+{
+    uint64_t bits;
+    if (!read_varint(bits))
+        return false;
+
+    value = static_cast<int64_t>((bits >> 1) ^ (~(bits & 1) + 1));
+    return true;
 }
 
 void Packet::set_type(PacketType type)
@@ -231,6 +480,7 @@ void Packet::set_type(PacketType type)
 
     /* Set the field */
     m_cmd |= static_cast<uint16_t>(type) << kPacketTypeShift;
+    m_wire_len = 0;
 }
 
 PacketType Packet::get_type()
@@ -246,15 +496,58 @@ bool Packet::is_type(PacketType type)
 void Packet::set_flag(PacketFlag flag)
 {
     m_cmd |= (flag << kPacketFlagShift) & kPacketFlagMask;
+    m_wire_len = 0;
 }
 
 void Packet::unset_flag(PacketFlag flag)
 {
     m_cmd &= ~(flag << kPacketFlagShift);
+    m_wire_len = 0;
+}
+
+void Packet::set_sequence(SeqNum seq)
+{
+    m_sequence_num = seq;
+    m_wire_len = 0;
+}
+
+void Packet::set_timestamp(uint32_t timestamp)
+{
+    m_timestamp = timestamp;
+    m_wire_len = 0;
+}
+
+std::size_t Packet::header_len()
+{
+    std::size_t len = kFrameHeaderLen;
+
+    if (has_sequence())
+        len += sizeof(SeqNum);
+
+    if (has_flag(PacketFlag::TIMESTAMPED))
+        len += sizeof(m_timestamp);
+
+    if (has_flag(PacketFlag::FRAGMENT))
+        len += kFragmentHeaderLen;
+
+    return len;
+}
+
+std::size_t Packet::raw_len()
+{
+    return header_len() + data_len();
 }
 
-std::size_t Packet::read_raw(uint8_t* buf, std::size_t buf_size)
+std::size_t Packet::serialize()
 {
+    /* The header only changes with the command, sequence number or payload,
+     * so retransmissions reuse the frame written for the first send */
+    if (m_wire_len)
+        return m_wire_len;
+
+    std::size_t header = header_len();
+    m_wire_offset = kHeaderRoom - header;
+    uint8_t* buf = &m_buffer[m_wire_offset];
     std::size_t write_pos = 0;
 
     /* Write command */
@@ -262,20 +555,42 @@ std::size_t Packet::read_raw(uint8_t* buf, std::size_t buf_size)
     std::memcpy(&buf[write_pos], &cmd_n, sizeof(cmd_n));
     write_pos += sizeof(cmd_n);
 
-    if (has_flag(PacketFlag::RELIABLE)) {
+    /* Write payload length */
+    uint16_t len_n = platform::HostToNet16(static_cast<uint16_t>(data_len()));
+    std::memcpy(&buf[write_pos], &len_n, sizeof(len_n));
+    write_pos += sizeof(len_n);
+
+    if (has_sequence()) {
         /* Write sequence number */
         SeqNum seq_net = platform::HostToNet32(m_sequence_num);
         std::memcpy(&buf[write_pos], &seq_net, sizeof(seq_net));
         write_pos += sizeof(seq_net);
     }
 
-    /* Write data */
-    if (m_data.size()) {
-        std::memcpy(&buf[write_pos], &m_data[0], m_data.size());
-        write_pos += m_data.size();
+    if (has_flag(PacketFlag::TIMESTAMPED)) {
+        /* Write send timestamp */
+        uint32_t ts_net = platform::HostToNet32(m_timestamp);
+        std::memcpy(&buf[write_pos], &ts_net, sizeof(ts_net));
+        write_pos += sizeof(ts_net);
     }
 
-    return write_pos;
+    if (has_flag(PacketFlag::FRAGMENT)) {
+        /* Write fragment index, count and message length */
+        uint16_t index_n = platform::HostToNet16(m_fragment_index);
+        uint16_t count_n = platform::HostToNet16(m_fragment_count);
+        uint32_t total_n = platform::HostToNet32(m_fragment_total);
+        std::memcpy(&buf[write_pos], &index_n, sizeof(index_n));
+        write_pos += sizeof(index_n);
+        std::memcpy(&buf[write_pos], &count_n, sizeof(count_n));
+        write_pos += sizeof(count_n);
+        std::memcpy(&buf[write_pos], &total_n, sizeof(total_n));
+        write_pos += sizeof(total_n);
+    }
+
+    /* The payload already follows the header */
+    m_wire_len = header + data_len();
+
+    return m_wire_len;
 }
 
 } // namespace chatter
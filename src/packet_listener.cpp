@@ -52,6 +52,9 @@ std::string PacketListener::debug_string(const PacketStats &packet_stats, const
     case PacketType::USER_DATA:
         os << " DATA";
         break;
+    case PacketType::PROTO_SPLIT:
+        os << " SPLIT";
+        break;
     default:
         break;
     }
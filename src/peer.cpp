@@ -1,16 +1,29 @@
 #include "chatter/peer.h"
 
-#include <algorithm>
-
 #include "chatter/config.h"
 
 namespace chatter {
 
 Peer::Peer()
+    : m_congestion(CongestionController::create(CongestionAlgorithm::RENO))
 {
     reset();
 }
 
+void Peer::set_congestion_control(CongestionAlgorithm algorithm)
+{
+    if (m_congestion->algorithm() != algorithm)
+        m_congestion = CongestionController::create(algorithm);
+    m_congestion->set_segment_size(max_datagram());
+    m_congestion->reset();
+}
+
+void Peer::set_mtu(uint16_t mtu)
+{
+    m_mtu = mtu;
+    m_congestion->set_segment_size(max_datagram());
+}
+
 Packet::ptr Peer::ack_packet(ProtocolChannelID channel_id, SeqNum sequence_num)
 {
     /* 0 -> 31 are ordered channels, 32 is used for unordered reliable */
@@ -18,22 +31,75 @@ Packet::ptr Peer::ack_packet(ProtocolChannelID channel_id, SeqNum sequence_num)
         return nullptr;
 
     Packet::ptr packet = nullptr;
+    if (m_channels[channel_id].sent_reliable.remove(sequence_num, &packet))
+        packet->m_resend_timer.cancel();
+
+    return packet;
+}
+
+void Peer::ack_packets(ProtocolChannelID channel_id, SeqNum cumulative, uint64_t sack_mask, std::vector<Packet::ptr>& acked)
+{
+    if (channel_id > 32)
+        return;
+
+    SequenceBuffer<Packet::ptr>& sent = m_channels[channel_id].sent_reliable;
+    Packet::ptr packet;
+
+    /* Everything covered by the cumulative ack is a run at the head of the ring */
+    while (!sent.empty() && sequence_less_than(sent.head(), cumulative)) {
+        sent.remove(sent.head(), &packet);
+        packet->m_resend_timer.cancel();
+        acked.push_back(packet);
+    }
+
+    /* Bit i of the sack mask covers cumulative + 1 + i */
+    for (int i = 0; sack_mask && i < 64; ++i, sack_mask >>= 1) {
+        if ((sack_mask & 1) && sent.remove(cumulative + 1 + i, &packet)) {
+            packet->m_resend_timer.cancel();
+            acked.push_back(packet);
+        }
+    }
+}
+
+bool Peer::record_received(ProtocolChannelID channel_id, SeqNum sequence)
+{
+    if (channel_id > 32)
+        return false;
+
     ProtocolChannel& chan = m_channels[channel_id];
+    int32_t distance = static_cast<int32_t>(sequence - chan.recv_next);
+
+    if (distance < 0 || distance >= kReceiveWindowSize)
+        return false;
 
-    std::list<Packet::ptr>::iterator itr;
-    itr = std::find_if(
-            chan.sent_reliable.begin(),
-            chan.sent_reliable.end(),
-            [&](Packet::ptr p){return p->m_sequence_num == sequence_num;}
-        );
-
-    if (itr != chan.sent_reliable.end()) {
-        /* Found the packet! */
-        packet = *itr;
-        chan.sent_reliable.erase(itr);
+    if (distance == 0) {
+        /* Advance the cumulative point over any run already received */
+        chan.recv_next++;
+        while (chan.recv_window[chan.recv_next % kReceiveWindowSize]) {
+            chan.recv_window.reset(chan.recv_next % kReceiveWindowSize);
+            chan.recv_next++;
+        }
+        return true;
     }
 
-    return packet;
+    if (chan.recv_window[sequence % kReceiveWindowSize])
+        return false;
+
+    chan.recv_window.set(sequence % kReceiveWindowSize);
+    return true;
+}
+
+bool Peer::record_sequenced(ProtocolChannelID channel_id, SeqNum sequence)
+{
+    if (channel_id > 32)
+        return false;
+
+    ProtocolChannel& chan = m_channels[channel_id];
+    if (sequence_less_than(sequence, chan.recv_sequenced_next))
+        return false;
+
+    chan.recv_sequenced_next = sequence + 1;
+    return true;
 }
 
 void Peer::reset()
@@ -47,19 +113,128 @@ void Peer::reset()
     m_last_rtt_ts = 0;
     m_rtt_avg = 0;
     m_rtt_dev = 0;
-    m_congestion_window = kMinCongestionWindow;
+    m_clock_offset = 0;
+    m_clock_offset_rtt = 0;
+    m_clock_sync_ts = 0;
+    m_mtu = kBaseMTU;
+    m_mtu_ceiling = kMaxMTU;
+    m_mtu_probe = 0;
+    m_mtu_probe_count = 0;
+    m_mtu_settled = false;
+    m_mtu_search_started = false;
+    m_congestion->set_segment_size(max_datagram());
+    m_congestion->reset();
     m_bytes_on_wire = 0;
+    m_recovery_ts = 0;
+    m_rack_ts = 0;
+    m_pacing_ts = 0;
+    m_batch_slot = -1;
+    m_split_id = 0;
+    m_splits.clear();
+    m_send_queue.clear();
+
+    m_service_timer.type = TimerType::PEER_SERVICE;
+    m_service_timer.owner = this;
+    m_service_timer.cancel();
+    m_ack_timer.type = TimerType::PEER_ACK;
+    m_ack_timer.owner = this;
+    m_ack_timer.cancel();
+    m_pacing_timer.type = TimerType::PEER_PACING;
+    m_pacing_timer.owner = this;
+    m_pacing_timer.cancel();
+    m_mtu_timer.type = TimerType::PEER_MTU_PROBE;
+    m_mtu_timer.owner = this;
+    m_mtu_timer.cancel();
 
     for (int i = 0; i < 33; ++i) {
+        SequenceBuffer<Packet::ptr>& sent = m_channels[i].sent_reliable;
+        for (SeqNum seq = sent.head(); seq != sent.tail(); ++seq) {
+            Packet::ptr* p = sent.find(seq);
+            if (p)
+                (*p)->m_resend_timer.cancel();
+        }
         m_channels[i].sent_reliable.clear();
         m_channels[i].next_sequence = 0;
+        m_channels[i].send_limit = kReceiveWindowSize;
+        m_channels[i].next_sequenced = 0;
+        m_channels[i].recv_next = 0;
+        m_channels[i].recv_window.reset();
+        m_channels[i].recv_held.clear();
+        m_channels[i].recv_sequenced_next = 0;
+        m_channels[i].assemblies.clear();
+        m_channels[i].ack_pending = false;
         m_channels[i].id = i;
     }
 }
 
-uint16_t Peer::get_rto()
+bool Peer::receive_window_open(const Packet::ptr& packet)
+{
+    if (!packet->has_flag(PacketFlag::RELIABLE))
+        return true;
+
+    return sequence_less_than(packet->m_sequence_num, m_channels[packet->get_channel()].send_limit);
+}
+
+void Peer::pacing_sent(uint64_t timestamp, std::size_t bytes)
+{
+    uint64_t rate = m_congestion->pacing_rate(m_rtt_avg);
+    if (!rate) {
+        m_pacing_ts = 0;
+        return;
+    }
+
+    /* Unused time is credited, but only up to a quantum - an idle peer can't
+     * save up a whole window to burst later */
+    uint64_t quantum = static_cast<uint64_t>(kPacingQuantum) * 1000000 / rate;
+    if (timestamp > quantum && m_pacing_ts < timestamp - quantum)
+        m_pacing_ts = timestamp - quantum;
+
+    m_pacing_ts += bytes * 1000000 / rate;
+}
+
+void Peer::update_clock_offset(uint64_t sent, uint64_t remote_now, uint64_t received)
+{
+    /* Assuming a symmetric path the peer read its clock halfway through the
+     * round trip. The shorter the round trip the less room for error, so a
+     * sample is only taken if its round trip is close to the best seen -
+     * which decays so a route change can't lock the offset out. */
+    uint32_t rtt = static_cast<uint32_t>(received - sent);
+    int64_t sample = static_cast<int64_t>(remote_now) - static_cast<int64_t>(sent + rtt / 2);
+
+    m_clock_sync_ts = received;
+
+    if (!m_clock_offset_rtt) {
+        m_clock_offset = sample;
+        m_clock_offset_rtt = rtt;
+        return;
+    }
+
+    m_clock_offset_rtt += m_clock_offset_rtt / 8;
+    if (rtt > m_clock_offset_rtt)
+        return;
+
+    m_clock_offset_rtt = rtt;
+    m_clock_offset += (sample - m_clock_offset) / 4;
+}
+
+uint32_t Peer::one_way_delay(uint64_t now, uint32_t remote_timestamp)
+{
+    /* Our clock in the peer's terms, compared modulo 2^32 - an estimate that
+     * lands before the timestamp is just offset error, call it no delay */
+    if (!m_clock_offset_rtt)
+        /* No offset yet - nothing to go on */
+        return 0;
+
+    uint32_t remote_now = static_cast<uint32_t>(now + m_clock_offset);
+    int32_t delay = static_cast<int32_t>(remote_now - remote_timestamp);
+
+    return delay > 0 ? delay : 0;
+}
+
+uint32_t Peer::get_rto()
 {
-    return static_cast<uint16_t>(m_rtt_avg + 4 * m_rtt_dev);
+    /* The receiver may hold its ack back for up to kAckDelay */
+    return m_rtt_avg + 4 * m_rtt_dev + kAckDelay;
 }
 
 const HostAddress& Peer::get_address()
@@ -4,6 +4,7 @@
 #include <cstring>
 #include <iostream>
 #include <bitset>
+#include <algorithm>
 
 #include "chatter/host.h"
 #include "chatter/packet_listener.h"
@@ -12,6 +13,7 @@ namespace chatter {
 
 Protocol::Protocol(Host* host)
     : m_host(host)
+    , m_timers(kTimerTick)
 {
 }
 
@@ -19,6 +21,11 @@ Protocol::~Protocol()
 {
 }
 
+void Protocol::reset(uint64_t timestamp)
+{
+    m_timers.reset(timestamp);
+}
+
 void Protocol::send(Packet::ptr packet, bool immediate /* = false */)
 {
     if (!packet)
@@ -26,26 +33,93 @@ void Protocol::send(Packet::ptr packet, bool immediate /* = false */)
 
     Peer* peer = packet->m_peer;
 
+    if (packet->is_type(PacketType::USER_DATA) && packet->raw_len() > peer->max_datagram()) {
+        /* Too large for one datagram */
+        send_fragments(packet, immediate);
+        return;
+    }
+
     if (packet->has_flag(PacketFlag::RELIABLE)) {
         /* Assign a sequence number for this packet and track it.*/
         ProtocolChannel& chan = peer->m_channels[packet->get_channel()];
-        packet->m_sequence_num = chan.next_sequence++;
-        chan.sent_reliable.push_back(packet);
+        packet->set_sequence(chan.next_sequence++);
+        chan.sent_reliable.insert(packet->m_sequence_num, packet);
+    }
+    else if (packet->has_flag(PacketFlag::SEQUENCED)) {
+        /* Only lets the receiver drop stale packets - nothing is tracked */
+        ProtocolChannel& chan = peer->m_channels[packet->get_channel()];
+        packet->set_sequence(chan.next_sequenced++);
     }
 
+    if (packet->has_flag(PacketFlag::TIMESTAMPED))
+        /* Stamped here so the receiver's delay includes our send queue and
+         * pacing, and stays with the packet through any retransmission */
+        packet->set_timestamp(static_cast<uint32_t>(m_host->now()));
+
     packet->m_rto = limit_rto(peer->get_rto());
     packet->m_send_queued = true;
 
     m_host->queue_outgoing_packet(packet, immediate);
 }
 
+void Protocol::send_fragments(Packet::ptr packet, bool immediate)
+{
+    std::size_t total = packet->data_len();
+    if (total > kMaxMessageSize) {
+        /* Too big to reassemble - the receiver would refuse it */
+        m_host->post_not_delivered(packet->m_peer->m_address, packet);
+        return;
+    }
+
+    /* Every fragment is reliable - otherwise one lost piece would lose the
+     * whole message. Sequenced delivery has no meaning for the pieces. */
+    auto first = Packet::create();
+    first->m_cmd = packet->m_cmd;
+    first->set_flag(PacketFlag::RELIABLE);
+    first->set_flag(PacketFlag::FRAGMENT);
+    first->unset_flag(PacketFlag::SEQUENCED);
+
+    /* Fragments are all the same size bar the last, so the receiver can place
+     * any of them from its index alone */
+    std::size_t max_payload = packet->m_peer->max_datagram() - first->header_len();
+    std::size_t count = (total + max_payload - 1) / max_payload;
+    std::size_t size = (total + count - 1) / count;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        Packet::ptr fragment = i ? Packet::create() : first;
+        fragment->m_cmd = first->m_cmd;
+        fragment->m_peer = packet->m_peer;
+        fragment->m_fragment_index = static_cast<uint16_t>(i);
+        fragment->m_fragment_count = static_cast<uint16_t>(count);
+        fragment->m_fragment_total = static_cast<uint32_t>(total);
+        fragment->set_payload(packet->data() + i * size, std::min(size, total - i * size));
+
+        /* Consecutive sends on a channel take consecutive sequence numbers */
+        send(fragment, immediate);
+    }
+}
+
+void Protocol::packet_sent(const Packet::ptr& packet)
+{
+    /* Arm the retransmission timer from the time the packet actually left */
+    if (packet->has_flag(PacketFlag::RELIABLE))
+        m_timers.schedule(&packet->m_resend_timer, packet->m_last_send_time + packet->m_rto + 1);
+}
+
+void Protocol::schedule_pacing(Peer* peer)
+{
+    if (!peer->m_pacing_timer.scheduled())
+        m_timers.schedule(&peer->m_pacing_timer, peer->m_pacing_ts);
+}
+
 bool Protocol::connect(Peer* peer)
 {
     if (peer->m_state != PeerState::DISCONNECTED)
         return false;
 
     peer->m_state = PeerState::CONNECTION_REQUESTED;
-    peer->m_connect_ts = m_host->timestamp_now();
+    peer->m_connect_ts = m_host->now();
+    schedule_update(peer);
 
     auto p = Packet::create();
     p->m_peer = peer;
@@ -77,28 +151,51 @@ std::vector<Packet::ptr> Protocol::parse_message(Peer* peer, const uint8_t* msg,
     std::vector<Packet::ptr> packets;
     std::size_t msg_cursor = 0;
 
-    while (msg_cursor < msg_size) {
-        packets.push_back(std::make_shared<Packet>());
-        Packet::ptr p = packets.back();
+    while (msg_size - msg_cursor >= Packet::kFrameHeaderLen) {
+        Packet::ptr p = Packet::create();
         p->m_peer = peer;
 
         p->m_cmd = platform::NetToHost16(*reinterpret_cast<const ProtocolCommand*>(&msg[msg_cursor]));
-        msg_cursor += sizeof(ProtocolCommand);
+        std::size_t data_len = platform::NetToHost16(*reinterpret_cast<const uint16_t*>(&msg[msg_cursor + sizeof(ProtocolCommand)]));
+
+        if (msg_cursor + p->header_len() + data_len > msg_size)
+            /* Truncated frame - discard it and anything after it */
+            break;
 
-        if (p->has_flag(PacketFlag::RELIABLE)) {
+        msg_cursor += Packet::kFrameHeaderLen;
+
+        if (p->has_sequence()) {
             /* Read sequence number */
             p->m_sequence_num = platform::NetToHost32(*reinterpret_cast<const SeqNum*>(&msg[msg_cursor]));
             msg_cursor += sizeof(SeqNum);
         }
 
-        int data_len = msg_size - msg_cursor;
-        if (data_len > 0) {
-            p->m_data.resize(data_len);
-            std::memcpy(&p->m_data[0], &msg[msg_cursor], data_len);
+        if (p->has_flag(PacketFlag::TIMESTAMPED)) {
+            /* Read send timestamp and estimate how long ago that was */
+            p->m_timestamp = platform::NetToHost32(*reinterpret_cast<const uint32_t*>(&msg[msg_cursor]));
+            msg_cursor += sizeof(uint32_t);
+            p->m_one_way_delay = peer->one_way_delay(m_host->now(), p->m_timestamp);
+        }
+
+        if (p->has_flag(PacketFlag::FRAGMENT)) {
+            /* Read fragment index, count and message length */
+            p->m_fragment_index = platform::NetToHost16(*reinterpret_cast<const uint16_t*>(&msg[msg_cursor]));
+            p->m_fragment_count = platform::NetToHost16(*reinterpret_cast<const uint16_t*>(&msg[msg_cursor + sizeof(uint16_t)]));
+            p->m_fragment_total = platform::NetToHost32(*reinterpret_cast<const uint32_t*>(&msg[msg_cursor + sizeof(uint16_t) * 2]));
+            msg_cursor += Packet::kFragmentHeaderLen;
+
+            /* The payload is left where it is and copied once, straight into
+             * the reassembly buffer */
+            p->m_fragment_data = &msg[msg_cursor];
+            p->m_fragment_len = data_len;
+            msg_cursor += data_len;
+        }
+        else if (data_len > 0) {
+            p->set_payload(&msg[msg_cursor], data_len);
+            msg_cursor += data_len;
         }
 
-        /* TODO(ben): Do proper multi-packet message parsing later */
-        msg_cursor = msg_size;
+        packets.push_back(p);
     }
 
     return packets;
@@ -111,15 +208,25 @@ bool Protocol::handle_ping(const Packet::ptr packet)
         /* TODO(ben): Peer not connected error */
         return false;
 
-    peer->m_last_ping_ts = m_host->timestamp_now();
+    peer->m_last_ping_ts = m_host->now();
 
     uint64_t remote_timestamp;
     packet->read(remote_timestamp);
 
+    /* An MTU probe carries its size, then padding */
+    uint16_t probe = 0;
+    if (packet->check_bounds(sizeof(probe)))
+        packet->read(probe);
+
+    /* Echo the pinger's timestamp and add ours, so it can work out both the
+     * round trip and the offset between our clocks. The pong is small
+     * whatever the size of the ping. */
     auto p = Packet::create();
     p->m_peer = peer;
     p->set_type(PacketType::PROTO_PONG);
     p->write(remote_timestamp);
+    p->write(m_host->now());
+    p->write(probe);
     send(p, true); /* Send immediate to get accurate round-trip time (TODO) */
 
     return true;
@@ -135,53 +242,115 @@ bool Protocol::handle_pong(const Packet::ptr packet)
     uint64_t ts;
     packet->read(ts);
 
-    calculate_rtt(peer, m_host->timestamp_now() - ts);
+    calculate_rtt(peer, m_host->now() - ts);
+    peer->m_congestion->on_rtt_sample(m_host->now(), static_cast<uint32_t>(m_host->now() - ts));
+
+    if (packet->check_bounds(sizeof(uint64_t))) {
+        uint64_t remote_now;
+        packet->read(remote_now);
+        peer->update_clock_offset(ts, remote_now, m_host->now());
+    }
+
+    uint16_t probe = 0;
+    if (packet->check_bounds(sizeof(probe)))
+        packet->read(probe);
+
+    peer_answering(peer, m_host->now());
+
+    if (probe && probe == peer->m_mtu_probe) {
+        /* The probe got through - the path carries at least this much.
+         * Carry straight on with the search. */
+        if (probe > peer->m_mtu)
+            peer->set_mtu(probe);
+        peer->m_mtu_probe = 0;
+        m_timers.schedule(&peer->m_mtu_timer, m_host->now());
+    }
 
     return true;
 }
 
 bool Protocol::handle_ack(const Packet::ptr packet)
 {
-    uint8_t channel_id = kReliableUnorderedChannel; /* default to unordered reliable channel */
-    SeqNum seq_num;
-
-    packet->read(seq_num);
-
-    if (packet->has_more_data())
-        packet->read(channel_id);
+    Peer* peer = packet->m_peer;
 
-    if (packet->m_peer->m_state == PeerState::DISCONNECT_PENDING) {
+    if (peer->m_state == PeerState::DISCONNECT_PENDING) {
         /* Treat any ack coming in after DISCONNECT_PENDING state is set as
          * a disconnect acknowledgement.
          */
-        packet->m_peer->reset();
-        auto e = Event::create(EventType::PEER_DISCONNECTED);
-        e->address = packet->m_peer->m_address;
-        e->packet = packet;
-        m_host->queue_event(e);
+        HostAddress address = peer->m_address;
+        m_host->release_peer(peer);
+        m_host->post_event(EventType::PEER_DISCONNECTED, address, packet);
         return true;
     }
 
-    auto sent = packet->m_peer->ack_packet(channel_id, seq_num);
+    uint8_t block_count = 0;
+    packet->read(block_count);
 
-    if (!sent) {
-        /* TODO(ben): check for dup ack - perform fast recovery etc etc */
-    }
-    else {
-        /* Acked packet - decrement bytes on wire */
-        sent->m_peer->m_bytes_on_wire -= sent->data_len();
+    for (uint8_t block = 0; block < block_count; ++block) {
+        uint8_t channel_id;
+        SeqNum cumulative;
+        uint16_t window;
+        uint64_t sack_mask;
+
+        if (!packet->check_bounds(sizeof(channel_id) + sizeof(cumulative) + sizeof(window) + sizeof(sack_mask)))
+            break;
+
+        packet->read(channel_id);
+        packet->read(cumulative);
+        packet->read(window);
+        packet->read(sack_mask);
+
+        if (channel_id <= kReliableUnorderedChannel) {
+            /* Window updates only ever move forward - acks can arrive reordered */
+            ProtocolChannel& chan = peer->m_channels[channel_id];
+            if (sequence_less_than(chan.send_limit, cumulative + window))
+                chan.send_limit = cumulative + window;
+        }
+
+        m_acked.clear();
+        peer->ack_packets(channel_id, cumulative, sack_mask, m_acked);
+
+        if (m_acked.empty())
+            /* Duplicate ack - it tells us nothing the last one didn't */
+            continue;
+
+        for (auto& sent : m_acked) {
+            /* Acked packet - decrement bytes on wire */
+            peer->m_bytes_on_wire -= sent->data_len();
 
-        if (sent->m_send_count == 1) {
-            /* No retransmissions were made for this packet, we can use it to calc RTT */
-            calculate_rtt(sent->m_peer, m_host->timestamp_now() - sent->m_last_send_time);
+            uint32_t rtt = 0;
+            if (sent->m_send_count == 1) {
+                /* No retransmissions were made for this packet, we can use it to calc RTT */
+                rtt = static_cast<uint32_t>(m_host->now() - sent->m_last_send_time);
+                calculate_rtt(peer, rtt);
 
-            /* Also use this ack to increase congestion window */
-            packet->m_peer->m_congestion_window += kCongestionInc;
-            if (packet->m_peer->m_congestion_window > kMaxCongestionWindow)
-                packet->m_peer->m_congestion_window = kMaxCongestionWindow;
+                /* A resent packet's ack may be for the original, so only first
+                 * sends say when the newest delivered packet left */
+                if (sent->m_last_send_time > peer->m_rack_ts)
+                    peer->m_rack_ts = sent->m_last_send_time;
+            }
+
+            peer->m_congestion->on_ack(m_host->now(), sent->data_len(), rtt, peer->m_bytes_on_wire);
         }
+
+        /* Highest sequence number the receiver holds */
+        SeqNum highest = cumulative - 1;
+        for (int i = 63; i >= 0; --i) {
+            if (sack_mask & (static_cast<uint64_t>(1) << i)) {
+                highest = cumulative + 1 + i;
+                break;
+            }
+        }
+
+        detect_losses(peer, channel_id, highest, m_host->now());
     }
 
+    /* The acks may have opened the congestion or receive window */
+    m_host->mark_send_due(peer);
+
+    if (peer->m_state == PeerState::CONNECTED)
+        peer_answering(peer, m_host->now());
+
     return true;
 }
 
@@ -195,7 +364,8 @@ bool Protocol::handle_connect_request(const Packet::ptr packet)
     peer->m_state = PeerState::CONNECTION_RESPONDED;
     peer->m_is_incoming_connection = true;
 
-    peer->m_connect_ts = m_host->timestamp_now();
+    peer->m_connect_ts = m_host->now();
+    schedule_update(peer);
 
     /* Send response back to peer */
     auto p = Packet::create();
@@ -216,8 +386,8 @@ bool Protocol::handle_connect_response(const Packet::ptr packet)
         /* TODO(ben): Peer didn't initiate a connection error ? */
         return false;
 
-    peer->m_rtt_avg = m_host->timestamp_now() - peer->m_connect_ts;
-    peer->m_last_rtt_ts = m_host->timestamp_now();
+    peer->m_rtt_avg = m_host->now() - peer->m_connect_ts;
+    peer->m_last_rtt_ts = m_host->now();
 
     SeqNum seq_num;
     packet->read(seq_num);
@@ -230,7 +400,7 @@ bool Protocol::handle_connect_response(const Packet::ptr packet)
         peer->m_bytes_on_wire -= sent->data_len();
 
     if (!ok) {
-        peer->m_state = PeerState::DISCONNECTED;
+        m_host->release_peer(peer);
         return true;
     }
 
@@ -254,8 +424,8 @@ bool Protocol::handle_connect_acknowledge(const Packet::ptr packet)
         /* TODO(ben): Peer didn't respond to a connection error ? */
         return false;
 
-    peer->m_rtt_avg = m_host->timestamp_now() - peer->m_connect_ts;
-    peer->m_last_rtt_ts = m_host->timestamp_now();
+    peer->m_rtt_avg = m_host->now() - peer->m_connect_ts;
+    peer->m_last_rtt_ts = m_host->now();
 
     SeqNum seq_num;
     packet->read(seq_num);
@@ -266,6 +436,7 @@ bool Protocol::handle_connect_acknowledge(const Packet::ptr packet)
         peer->m_bytes_on_wire -= sent->data_len();
 
     peer->m_state = PeerState::CONNECTED;
+    schedule_update(peer);
 
     auto p = Packet::create();
     p->m_peer = peer;
@@ -274,9 +445,13 @@ bool Protocol::handle_connect_acknowledge(const Packet::ptr packet)
     p->write(packet->m_sequence_num); /* Sequence number of incoming packet */
     send(p, true);
 
-    auto e = Event::create(EventType::PEER_CONNECTED);
-    e->address = packet->m_peer->m_address;
-    m_host->queue_event(e);
+    /* Start clock offset estimation straight away, TIMESTAMPED packets need
+     * it. After CONNECT_COMPLETE, the peer ignores pings until it has that.
+     * The MTU search waits until the peer is known to be answering, as
+     * unanswered probes count against the path. */
+    send_ping(peer, m_host->now());
+
+    m_host->post_event(EventType::PEER_CONNECTED, packet->m_peer->m_address);
 
     return true;
 }
@@ -297,10 +472,14 @@ bool Protocol::handle_connect_complete(const Packet::ptr packet)
         peer->m_bytes_on_wire -= sent->data_len();
 
     peer->m_state = PeerState::CONNECTED;
+    schedule_update(peer);
+
+    send_ping(peer, m_host->now());
+
+    /* The peer was connected before sending CONNECT_COMPLETE */
+    peer_answering(peer, m_host->now());
 
-    auto e = Event::create(EventType::PEER_CONNECTED);
-    e->address = packet->m_peer->m_address;
-    m_host->queue_event(e);
+    m_host->post_event(EventType::PEER_CONNECTED, packet->m_peer->m_address);
 
     return true;
 };
@@ -312,11 +491,10 @@ bool Protocol::handle_disconnect_notify(const Packet::ptr packet)
         /* TODO(ben): Peer didn't initiate a connection error ? */
         return false;
 
-    peer->reset();
+    HostAddress address = peer->m_address;
+    m_host->release_peer(peer);
 
-    auto e = Event::create(EventType::PEER_DISCONNECTED);
-    e->address = packet->m_peer->m_address;
-    m_host->queue_event(e);
+    m_host->post_event(EventType::PEER_DISCONNECTED, address);
 
     return true;
 }
@@ -328,18 +506,222 @@ bool Protocol::handle_user_data(const Packet::ptr packet)
         /* TODO(ben): Peer didn't initiate a connection error ? */
         return false;
 
-    if (!packet->m_data.size())
+    if (packet->has_flag(PacketFlag::FRAGMENT)) {
+        complete_fragment(packet);
+        return true;
+    }
+
+    if (!packet->data_len())
+        return false;
+
+    m_host->post_event(EventType::PACKET_RECEIVED, packet->m_peer->m_address, packet);
+
+    return true;
+}
+
+void Protocol::release_ordered(const Packet::ptr packet)
+{
+    /* record_received has already moved recv_next past every contiguous
+     * sequence number - anything below it can go to the application. The
+     * hold is per channel, so a gap only blocks its own channel. */
+    Peer* peer = packet->m_peer;
+    ProtocolChannel& chan = peer->m_channels[packet->get_channel()];
+
+    if (!sequence_less_than(packet->m_sequence_num, chan.recv_next)) {
+        /* Ahead of a gap */
+        chan.recv_held.insert(packet->m_sequence_num, packet);
+        return;
+    }
+
+    handle_user_data(packet);
+
+    Packet::ptr held;
+    while (!chan.recv_held.empty() && sequence_less_than(chan.recv_held.head(), chan.recv_next)) {
+        chan.recv_held.remove(chan.recv_held.head(), &held);
+        handle_user_data(held);
+    }
+}
+
+bool Protocol::admit_fragment(const Packet::ptr packet)
+{
+    /* Limits what a peer can make us allocate up front: a fragment needing a
+     * new assembly is refused once its channel has kMaxFragmentAssemblies
+     * open or the peer holds kMaxReassemblyBytes */
+    Peer* peer = packet->m_peer;
+    ProtocolChannel& chan = peer->m_channels[packet->get_channel()];
+    SeqNum seq = packet->m_sequence_num;
+    SeqNum first = seq - packet->m_fragment_index;
+
+    if (sequence_less_than(seq, chan.recv_next) || chan.recv_window[seq % kReceiveWindowSize])
+        /* Duplicate - record_received sorts it out */
+        return true;
+
+    if (!sequence_less_than(chan.recv_next, first))
+        /* The message the channel is waiting on - always taken, otherwise
+         * later messages holding the budget could stall an ordered channel */
+        return true;
+
+    for (const auto& a : chan.assemblies) {
+        if (a.first == first)
+            return true;
+    }
+
+    if (chan.assemblies.size() >= kMaxFragmentAssemblies)
+        return false;
+
+    std::size_t held = 0;
+    for (const auto& c : peer->m_channels) {
+        for (const auto& a : c.assemblies)
+            held += a.packet->data_len();
+    }
+
+    return held + packet->m_fragment_total <= kMaxReassemblyBytes;
+}
+
+bool Protocol::store_fragment(const Packet::ptr packet)
+{
+    uint16_t index = packet->m_fragment_index;
+    uint16_t count = packet->m_fragment_count;
+    std::size_t total = packet->m_fragment_total;
+
+    if (!packet->has_flag(PacketFlag::RELIABLE) || index >= count || total > kMaxMessageSize || total < count)
+        return false;
+
+    /* Same split as send_fragments - equal sizes bar the last */
+    std::size_t size = (total + count - 1) / count;
+    std::size_t offset = index * size;
+    if (offset >= total || packet->m_fragment_len != std::min(size, total - offset))
+        return false;
+
+    ProtocolChannel& chan = packet->m_peer->m_channels[packet->get_channel()];
+    SeqNum first = packet->m_sequence_num - index;
+
+    FragmentAssembly* assembly = nullptr;
+    for (auto& a : chan.assemblies) {
+        if (a.first == first) {
+            assembly = &a;
+            break;
+        }
+    }
+
+    if (!assembly) {
+        chan.assemblies.emplace_back();
+        assembly = &chan.assemblies.back();
+        assembly->first = first;
+        assembly->count = count;
+        assembly->received = 0;
+        assembly->bitmap.assign((count + 63) / 64, 0);
+
+        /* The whole message is allocated on the first fragment to arrive */
+        assembly->packet = Packet::create();
+        assembly->packet->m_peer = packet->m_peer;
+        assembly->packet->m_cmd = packet->m_cmd;
+        assembly->packet->unset_flag(PacketFlag::FRAGMENT);
+        assembly->packet->m_sequence_num = first;
+        assembly->packet->m_timestamp = packet->m_timestamp;
+        assembly->packet->resize_payload(total);
+    }
+    else if (assembly->count != count || assembly->packet->data_len() != total) {
+        return false;
+    }
+
+    uint64_t bit = static_cast<uint64_t>(1) << (index % 64);
+    if (!(assembly->bitmap[index / 64] & bit)) {
+        std::memcpy(assembly->packet->payload() + offset, packet->m_fragment_data, packet->m_fragment_len);
+        assembly->bitmap[index / 64] |= bit;
+        assembly->received++;
+    }
+
+    return true;
+}
+
+void Protocol::complete_fragment(const Packet::ptr packet)
+{
+    /* Called for each fragment as it is delivered - after release_ordered on
+     * ordered channels, so by the time a message is complete everything
+     * sequenced before it has been delivered */
+    ProtocolChannel& chan = packet->m_peer->m_channels[packet->get_channel()];
+    SeqNum first = packet->m_sequence_num - packet->m_fragment_index;
+
+    for (auto itr = chan.assemblies.begin(); itr != chan.assemblies.end(); ++itr) {
+        if (itr->first != first)
+            continue;
+
+        if (itr->received == itr->count) {
+            Packet::ptr message = itr->packet;
+            message->m_one_way_delay = packet->m_one_way_delay;
+            chan.assemblies.erase(itr);
+            m_host->post_event(EventType::PACKET_RECEIVED, message->m_peer->m_address, message);
+        }
+        return;
+    }
+}
+
+bool Protocol::handle_split(const Packet::ptr packet)
+{
+    if (m_in_split)
+        return false;
+
+    uint16_t id, frame_len;
+    uint8_t index, count;
+    if (!packet->read(id) || !packet->read(index) || !packet->read(count) || !packet->read(frame_len))
+        return false;
+
+    if (index >= count || count > 32 || frame_len > kMaxDatagramSize || frame_len < count)
+        return false;
+
+    /* Same split as Host::send_split - equal sizes bar the last */
+    std::size_t size = (frame_len + count - 1) / count;
+    std::size_t offset = index * size;
+    std::size_t len = packet->data_len() - Packet::kSplitHeaderLen;
+    if (offset >= frame_len || len != std::min<std::size_t>(size, frame_len - offset))
+        return false;
+
+    Peer* peer = packet->m_peer;
+    auto itr = peer->m_splits.begin();
+    while (itr != peer->m_splits.end() && itr->id != id)
+        ++itr;
+
+    if (itr == peer->m_splits.end()) {
+        if (peer->m_splits.size() >= kMaxSplitAssemblies)
+            /* Oldest is most likely to have lost a piece - its packet will
+             * be split again under a new id */
+            peer->m_splits.erase(peer->m_splits.begin());
+
+        peer->m_splits.emplace_back();
+        itr = peer->m_splits.end() - 1;
+        itr->id = id;
+        itr->count = count;
+        itr->received = 0;
+        itr->bitmap = 0;
+        itr->frame.resize(frame_len);
+    }
+    else if (itr->count != count || itr->frame.size() != frame_len) {
         return false;
+    }
+
+    uint32_t bit = static_cast<uint32_t>(1) << index;
+    if (itr->bitmap & bit)
+        return true;
+
+    std::memcpy(&itr->frame[offset], packet->data() + Packet::kSplitHeaderLen, len);
+    itr->bitmap |= bit;
+    if (++itr->received < itr->count)
+        return true;
 
-    auto e = Event::create(EventType::PACKET_RECEIVED);
-    e->address = packet->m_peer->m_address;
-    e->packet = packet;
-    m_host->queue_event(e);
+    /* Complete - handled as if it had arrived in one datagram */
+    std::vector<uint8_t> frame;
+    frame.swap(itr->frame);
+    peer->m_splits.erase(itr);
+
+    m_in_split = true;
+    handle_message(peer, frame.data(), frame.size());
+    m_in_split = false;
 
     return true;
 }
 
-void Protocol::send_ack(Packet::ptr packet)
+bool Protocol::send_ack(Packet::ptr packet)
 {
     switch (packet->get_type()) {
         /* These packets should not generate an ack as they are handled
@@ -351,7 +733,7 @@ void Protocol::send_ack(Packet::ptr packet)
         case PacketType::CONNECT_REQUEST:
         case PacketType::CONNECT_RESPONSE:
         case PacketType::CONNECT_ACKNOWLEDGE:
-            return;
+            return false;
         /* These packets should generate normal acks. */
         case PacketType::CONNECT_COMPLETE:
         case PacketType::DISCONNECT_NOTIFY:
@@ -360,24 +742,76 @@ void Protocol::send_ack(Packet::ptr packet)
             break;
     }
 
+    Peer* peer = packet->m_peer;
+    ProtocolChannel& chan = peer->m_channels[packet->get_channel()];
+    chan.ack_pending = true;
+
+    if (packet->m_sequence_num + 1 != chan.recv_next)
+        /* Out of order or duplicate - caller should report the gap straight
+         * away, so the sender can fast retransmit what's missing */
+        return true;
+
+    if (!peer->m_ack_timer.scheduled())
+        m_timers.schedule(&peer->m_ack_timer, m_host->now() + kAckDelay);
+
+    return false;
+}
+
+void Protocol::flush_acks(Peer* peer, bool immediate /* = false */)
+{
+    /* One PROTO_ACK covers every channel with acks pending:
+     *   [block count: 8] then per channel
+     *   [channel: 8][cumulative: 32][window: 16][sack mask: 64]
+     * The cumulative ack is the next sequence number expected - all below it
+     * have been received. The window is how many sequence numbers from the
+     * cumulative ack the receiver will accept. Bit i of the sack mask is set
+     * if cumulative + 1 + i has been received.
+     */
     auto ack = Packet::create();
-    ack->m_peer = packet->m_peer;
+    ack->m_peer = peer;
     ack->set_type(PacketType::PROTO_ACK);
+    ack->write(static_cast<uint8_t>(0));
 
-    ack->write(packet->m_sequence_num);
-    if (packet->has_flag(PacketFlag::ORDERED))
-        ack->write(static_cast<uint8_t>(packet->get_channel()));
+    uint8_t block_count = 0;
+    for (auto& chan : peer->m_channels) {
+        if (!chan.ack_pending)
+            continue;
 
-    /* TODO(ben): send duplicate acks if unordered sequence received (fast retransmission support) */
-    send(ack, true);
+        uint64_t sack_mask = 0;
+        for (int i = 0; i < 64; ++i) {
+            if (chan.recv_window[(chan.recv_next + 1 + i) % kReceiveWindowSize])
+                sack_mask |= static_cast<uint64_t>(1) << i;
+        }
+
+        /* Held ordered packets sit inside the window, so it is always the full
+         * span the receive ring covers past the cumulative ack */
+        ack->write(static_cast<uint8_t>(chan.id));
+        ack->write(chan.recv_next);
+        ack->write(static_cast<uint16_t>(kReceiveWindowSize));
+        ack->write(sack_mask);
+
+        chan.ack_pending = false;
+        block_count++;
+    }
+
+    peer->m_ack_timer.cancel();
+
+    if (!block_count)
+        return;
+
+    ack->payload()[0] = block_count;
+
+    /* Queued so the ack can share a datagram with other packets headed to this peer */
+    send(ack, immediate);
 }
 
 void Protocol::handle_message(Peer* peer, const uint8_t* msg, std::size_t msg_size)
 {
     std::vector<Packet::ptr> packets = parse_message(peer, msg, msg_size);
+    bool ack_now = false;
 
     if (packets.size())
-        peer->m_last_recv_ts = m_host->timestamp_now();
+        peer->m_last_recv_ts = m_host->now();
 
     for (auto& p : packets) {
 
@@ -385,19 +819,48 @@ void Protocol::handle_message(Peer* peer, const uint8_t* msg, std::size_t msg_si
             PacketStats packet_s;
             PeerStats peer_s;
             m_host->build_packet_stats(p, packet_s, peer_s);
-            m_host->m_packet_listener->on_recv(m_host->timestamp_now(), packet_s, peer_s);
+            m_host->m_packet_listener->on_recv(m_host->now(), packet_s, peer_s);
         }
 #ifdef CHATTER_DEBUG
         /*
          *
-        std::cout << m_host->timestamp_now() << " RECV<<<";
+        std::cout << m_host->now() << " RECV<<<";
         std::cout << p->debug_string();
         std::cout << std::endl;
         */
 #endif
 
-        if (p->has_flag(RELIABLE))
-            send_ack(p);
+        if (p->has_flag(RELIABLE)) {
+            if (p->has_flag(FRAGMENT) && !admit_fragment(p))
+                /* Reassembly is full - left unacked, so the sender retransmits
+                 * it once earlier messages have completed */
+                continue;
+
+            bool is_new = peer->record_received(p->get_channel(), p->m_sequence_num);
+            if (send_ack(p))
+                ack_now = true;
+
+            if (p->is_type(PacketType::DISCONNECT_NOTIFY))
+                /* The peer is about to be reset, so ack right away */
+                flush_acks(peer, true);
+
+            if (!is_new)
+                /* Duplicate (or outside the receive window) - acked but not handled again */
+                continue;
+
+            if (p->has_flag(FRAGMENT) && !store_fragment(p))
+                /* Malformed - it is acked, but there is nothing to deliver */
+                continue;
+
+            if (p->has_flag(ORDERED)) {
+                release_ordered(p);
+                continue;
+            }
+        }
+        else if (p->has_flag(SEQUENCED) && !peer->record_sequenced(p->get_channel(), p->m_sequence_num)) {
+            /* Superseded by a newer packet already delivered - drop it */
+            continue;
+        }
 
         switch (p->get_type()) {
         case PacketType::PROTO_PING:
@@ -436,10 +899,17 @@ void Protocol::handle_message(Peer* peer, const uint8_t* msg, std::size_t msg_si
             handle_user_data(p);
             break;
 
+        case PacketType::PROTO_SPLIT:
+            handle_split(p);
+            break;
+
         default:
             break;
         }
     }
+
+    if (ack_now && peer->m_state != PeerState::DISCONNECTED)
+        flush_acks(peer);
 }
 
 bool Protocol::detect_disconnect(Peer* peer, uint64_t timestamp)
@@ -455,39 +925,188 @@ void Protocol::service_rtt(Peer* peer, uint64_t timestamp)
      * if RTT has not been calculated for a while */
     uint64_t time_since_last_ping = timestamp - peer->m_last_ping_ts;
 
-    if (time_since_last_ping > kPingInterval) {
-        /* Send Ping */
-        auto p = Packet::create();
-        p->m_peer = peer;
-        p->set_type(PacketType::PROTO_PING);
-        p->write(timestamp);
-        send(p, true);
-        peer->m_last_ping_ts = timestamp;
+    if (time_since_last_ping > kPingInterval)
+        send_ping(peer, timestamp);
+}
+
+void Protocol::send_ping(Peer* peer, uint64_t timestamp)
+{
+    auto p = Packet::create();
+    p->m_peer = peer;
+    p->set_type(PacketType::PROTO_PING);
+    p->write(timestamp);
+    send(p, true);
+    peer->m_last_ping_ts = timestamp;
+}
+
+void Protocol::start_mtu_search(Peer* peer, uint64_t timestamp)
+{
+    peer->m_mtu_ceiling = kMaxMTU;
+    peer->m_mtu_probe = 0;
+    peer->m_mtu_settled = false;
+    m_timers.schedule(&peer->m_mtu_timer, timestamp);
+}
+
+void Protocol::peer_answering(Peer* peer, uint64_t timestamp)
+{
+    /* Only handshake packets pass before the peer is connected at its end -
+     * an ack or pong means it will answer probes now */
+    if (peer->m_mtu_search_started)
+        return;
+
+    peer->m_mtu_search_started = true;
+    start_mtu_search(peer, timestamp);
+}
+
+void Protocol::service_mtu(Peer* peer, uint64_t timestamp)
+{
+    if (peer->m_state != PeerState::CONNECTED)
+        return;
+
+    if (peer->m_mtu_settled) {
+        /* kMtuRaiseInterval has passed - see if the path has grown since */
+        peer->m_mtu_settled = false;
+        peer->m_mtu_ceiling = kMaxMTU;
     }
+    else if (peer->m_mtu_probe) {
+        /* The outstanding probe went unanswered */
+        if (++peer->m_mtu_probe_count >= kMtuMaxProbes) {
+            peer->m_mtu_ceiling = peer->m_mtu_probe - 1;
+            peer->m_mtu_probe = 0;
+        }
+    }
+
+    if (!peer->m_mtu_probe) {
+        if (peer->m_mtu_ceiling - peer->m_mtu < kMtuProbeMinStep) {
+            /* Settled, whether the last probe got through or not */
+            peer->m_mtu_settled = true;
+            m_timers.schedule(&peer->m_mtu_timer, timestamp + kMtuRaiseInterval);
+            return;
+        }
+
+        /* Most paths are Ethernet, so try that before bisecting */
+        if (peer->m_mtu < kEthernetMTU && peer->m_mtu_ceiling >= kEthernetMTU)
+            peer->m_mtu_probe = kEthernetMTU;
+        else
+            peer->m_mtu_probe = peer->m_mtu + (peer->m_mtu_ceiling - peer->m_mtu + 1) / 2;
+        peer->m_mtu_probe_count = 0;
+    }
+
+    /* A ping padded out so its datagram is exactly the probe size, sent on
+     * its own - it is never coalesced or fragmented */
+    auto p = Packet::create();
+    p->m_peer = peer;
+    p->set_type(PacketType::PROTO_PING);
+    p->write(timestamp);
+    p->write(peer->m_mtu_probe);
+
+    std::size_t frame_len = peer->m_mtu_probe - kUDPHeaderSize;
+    p->resize_payload(frame_len - p->header_len());
+    send(p, true);
+
+    m_timers.schedule(&peer->m_mtu_timer, timestamp + limit_rto(peer->get_rto()));
 }
 
-void Protocol::do_resends(Peer* peer, uint64_t timestamp)
+void Protocol::do_resend(Packet::ptr p, uint64_t timestamp)
 {
-    uint64_t time_since_last_send = 0;
+    Peer* peer = p->m_peer;
+    uint64_t time_since_last_send = timestamp - p->m_last_send_time;
 
-    for (auto& chan : peer->m_channels) {
-        for (auto& p : chan.sent_reliable) {
-            time_since_last_send = timestamp - p->m_last_send_time;
+    if (!p->m_send_queued && time_since_last_send > p->m_rto) {
+        /* Packet timed out, need to retransmit */
+        /* Calculate the new time-out */
+        p->m_rto = limit_rto(p->m_rto * kRetransmissionBackOffFactor);
 
-            if (!p->m_send_queued && time_since_last_send > p->m_rto) {
-                /* Packet timed out, need to retransmit */
-                /* Calculate the new time-out */
-                p->m_rto = limit_rto(p->m_rto * kRetransmissionBackOffFactor);
+        enter_recovery(peer, p, timestamp);
 
-                /* Retransmissions trigger a congestion window decrease */
-                peer->m_congestion_window /= kCongestionDecFactor;
-                if (peer->m_congestion_window < kMinCongestionWindow)
-                    peer->m_congestion_window = kMinCongestionWindow;
+        if (p->m_send_count >= kMtuBlackHoleResends && peer->m_mtu > kBaseMTU) {
+            /* Repeated time-outs - the path may no longer carry our datagrams.
+             * Fall back to the base MTU and search again. */
+            peer->set_mtu(kBaseMTU);
+            start_mtu_search(peer, timestamp);
+        }
 
-                p->m_send_queued = true;
+        p->m_send_queued = true;
 
-                m_host->queue_outgoing_packet(p);
-            }
+        m_host->queue_outgoing_packet(p);
+    }
+}
+
+void Protocol::detect_losses(Peer* peer, ProtocolChannelID channel_id, SeqNum highest_acked, uint64_t timestamp)
+{
+    /* Everything below the cumulative ack has gone, so this only walks the
+     * gaps an ack's sack mask can describe */
+    SequenceBuffer<Packet::ptr>& sent = peer->m_channels[channel_id].sent_reliable;
+    uint64_t reorder_window = peer->m_rtt_avg / 4;
+
+    for (SeqNum seq = sent.head(); !sent.empty() && sequence_less_than(seq, highest_acked); ++seq) {
+        Packet::ptr* p = sent.find(seq);
+        if (!p || (*p)->m_send_queued)
+            continue;
+
+        /* Only packets sent before the newest delivered one can be judged -
+         * a fresh retransmission hasn't had time to arrive */
+        uint64_t send_time = (*p)->m_last_send_time;
+        if (send_time >= peer->m_rack_ts)
+            continue;
+
+        if (static_cast<int32_t>(highest_acked - seq) >= kFastRetransmitThreshold ||
+                send_time + reorder_window < peer->m_rack_ts) {
+            /* Lost - resend now rather than waiting out the RTO */
+            enter_recovery(peer, *p, timestamp);
+
+            (*p)->m_send_queued = true;
+            m_host->queue_outgoing_packet(*p);
+        }
+    }
+}
+
+void Protocol::enter_recovery(Peer* peer, const Packet::ptr& packet, uint64_t timestamp)
+{
+    /* A loss starts a new loss event unless the packet was sent before the
+     * current one began - one event only reduces the window once */
+    if (!peer->m_recovery_ts || packet->m_last_send_time > peer->m_recovery_ts) {
+        peer->m_recovery_ts = timestamp;
+        peer->m_congestion->on_loss(timestamp, peer->m_bytes_on_wire);
+    }
+}
+
+void Protocol::service_timers(uint64_t timestamp)
+{
+    Timer* timer;
+
+    while ((timer = m_timers.expire(timestamp))) {
+        switch (timer->type) {
+            case TimerType::PEER_SERVICE:
+                update(static_cast<Peer*>(timer->owner), timestamp);
+                break;
+
+            case TimerType::PEER_ACK:
+                flush_acks(static_cast<Peer*>(timer->owner));
+                break;
+
+            case TimerType::PEER_PACING:
+                /* Its held packets go out when the send queue is serviced, after the timers */
+                m_host->mark_send_due(static_cast<Peer*>(timer->owner));
+                break;
+
+            case TimerType::PEER_MTU_PROBE:
+                service_mtu(static_cast<Peer*>(timer->owner), timestamp);
+                break;
+
+            case TimerType::PACKET_RESEND:
+                {
+                    /* Look the packet up by sequence number to get hold of its shared pointer */
+                    Packet* packet = static_cast<Packet*>(timer->owner);
+                    ProtocolChannel& chan = packet->m_peer->m_channels[packet->get_channel()];
+                    Packet::ptr* p = chan.sent_reliable.find(packet->m_sequence_num);
+                    if (p)
+                        do_resend(*p, timestamp);
+                }
+                break;
+
+            default:
+                break;
         }
     }
 }
@@ -509,15 +1128,11 @@ void Protocol::update(Peer* peer, uint64_t timestamp)
                 uint64_t time_since_connect = timestamp - peer->m_connect_ts;
                 if (time_since_connect > kConnectTimeOut) {
                     if (!peer->m_is_incoming_connection) {
-                        auto e = Event::create(EventType::PEER_UNABLE_TO_CONNECT);
-                        e->address = peer->m_address;
-                        m_host->queue_event(e);
+                        m_host->post_event(EventType::PEER_UNABLE_TO_CONNECT, peer->m_address);
                     }
-                    peer->reset();
+                    m_host->release_peer(peer);
                     return;
                 }
-                /* Reliable packet re-sends */
-                do_resends(peer, timestamp);
             }
             break;
 
@@ -525,25 +1140,58 @@ void Protocol::update(Peer* peer, uint64_t timestamp)
             {
                 /* Disconnect detection */
                 if (detect_disconnect(peer, timestamp)) {
-                    auto e = Event::create(EventType::PEER_TIMED_OUT);
-                    e->address = peer->m_address;
-                    m_host->queue_event(e);
-                    peer->reset();
+                    m_host->post_event(EventType::PEER_TIMED_OUT, peer->m_address);
+                    m_host->release_peer(peer);
+                    return;
                 }
 
-                /* Keep RTT calculations happening */
+                /* Keep RTT calculations and the clock offset fresh */
                 uint64_t time_since_last_rtt = timestamp - peer->m_last_rtt_ts;
-                if (time_since_last_rtt > kPingInterval)
+                uint64_t time_since_last_sync = timestamp - peer->m_clock_sync_ts;
+                if (time_since_last_rtt > kPingInterval || time_since_last_sync > kClockSyncInterval ||
+                        !peer->m_clock_offset_rtt)
                     service_rtt(peer, timestamp);
-
-                /* Reliable packet re-sends */
-                do_resends(peer, timestamp);
             }
             break;
 
         default:
             break;
     }
+
+    schedule_update(peer);
+}
+
+void Protocol::schedule_update(Peer* peer)
+{
+    /* Work out when update() next has something to do for this peer. It
+     * re-checks the real conditions, so an early wake-up is harmless. */
+    uint64_t deadline;
+
+    switch (peer->m_state) {
+        case PeerState::CONNECTION_REQUESTED:
+        case PeerState::CONNECTION_RESPONDED:
+        case PeerState::CONNECTION_ACKNOWLEDGED:
+            deadline = peer->m_connect_ts + kConnectTimeOut + 1;
+            break;
+
+        case PeerState::CONNECTED:
+            {
+                uint64_t timeout = peer->m_last_recv_ts + kPeerTimeOut + 1;
+                uint64_t ping = std::max(peer->m_last_rtt_ts, peer->m_last_ping_ts) + kPingInterval + 1;
+                uint64_t sync = peer->m_last_ping_ts + kPingInterval + 1;
+                if (peer->m_clock_offset_rtt)
+                    sync = std::max(sync, peer->m_clock_sync_ts + kClockSyncInterval + 1);
+                ping = std::min(ping, sync);
+                deadline = std::min(timeout, ping);
+            }
+            break;
+
+        default:
+            peer->m_service_timer.cancel();
+            return;
+    }
+
+    m_timers.schedule(&peer->m_service_timer, deadline);
 }
 
 void Protocol::calculate_rtt(Peer* peer, uint64_t measurement)
@@ -554,20 +1202,20 @@ void Protocol::calculate_rtt(Peer* peer, uint64_t measurement)
     if (!peer)
         return;
 
-    float error = measurement - peer->m_rtt_avg;
+    float error = static_cast<float>(measurement) - peer->m_rtt_avg;
 
-    peer->m_rtt_avg += static_cast<uint64_t>(avg_gain * error);
-    peer->m_rtt_dev += static_cast<uint64_t>(dev_gain * (std::abs(error) - peer->m_rtt_dev));
-    peer->m_last_rtt_ts = m_host->timestamp_now();
+    peer->m_rtt_avg += static_cast<int64_t>(avg_gain * error);
+    peer->m_rtt_dev += static_cast<int64_t>(dev_gain * (std::abs(error) - peer->m_rtt_dev));
+    peer->m_last_rtt_ts = m_host->now();
 }
 
-uint16_t Protocol::limit_rto(uint16_t rto)
+uint32_t Protocol::limit_rto(uint64_t rto)
 {
     if (rto > kMaxRetransmissionInterval)
         rto = kMaxRetransmissionInterval;
     if (rto < kMinRetransmissionInterval)
         rto = kMinRetransmissionInterval;
-    return rto;
+    return static_cast<uint32_t>(rto);
 }
 
 } // namespace chatter
@@ -0,0 +1,128 @@
+#include "chatter/timer_wheel.h"
+
+namespace chatter {
+
+TimerWheel::TimerWheel(uint64_t tick_len /* = 1 */)
+    : m_tick_len(tick_len > 0 ? tick_len : 1)
+    , m_slots(kLevels * kSlots)
+{
+    reset(0);
+}
+
+void TimerWheel::reset(uint64_t now)
+{
+    for (auto& head : m_slots) {
+        while (head.m_next && head.m_next != &head)
+            head.m_next->cancel();
+        head.m_prev = head.m_next = &head;
+    }
+
+    m_current = now / m_tick_len;
+}
+
+Timer* TimerWheel::slot(int level, uint64_t tick)
+{
+    return &m_slots[level * kSlots + ((tick >> (level * kSlotBits)) & kSlotMask)];
+}
+
+void TimerWheel::schedule(Timer* timer, uint64_t deadline)
+{
+    timer->cancel();
+
+    /* Round up so a timer never fires before its deadline */
+    timer->m_deadline = deadline;
+    timer->m_tick = (deadline + m_tick_len - 1) / m_tick_len;
+    if (timer->m_tick <= m_current)
+        timer->m_tick = m_current + 1;
+
+    insert(timer);
+}
+
+void TimerWheel::insert(Timer* timer)
+{
+    uint64_t tick = timer->m_tick;
+    uint64_t delta = tick > m_current ? tick - m_current : 0;
+
+    int level = 0;
+    while (level < kLevels - 1 && delta >= (kSlots << (level * kSlotBits)))
+        level++;
+
+    /* Beyond the top level - park in its furthest slot, the timer is placed
+     * again when that slot cascades */
+    uint64_t max_delta = (kSlots << (level * kSlotBits)) - 1;
+    if (delta > max_delta)
+        tick = m_current + max_delta;
+
+    Timer* head = slot(level, tick);
+    timer->m_prev = head->m_prev;
+    timer->m_next = head;
+    head->m_prev->m_next = timer;
+    head->m_prev = timer;
+}
+
+void TimerWheel::cascade(int level)
+{
+    Timer* head = slot(level, m_current);
+
+    while (head->m_next != head) {
+        Timer* timer = head->m_next;
+        timer->cancel();
+        insert(timer);
+    }
+}
+
+Timer* TimerWheel::expire(uint64_t now)
+{
+    uint64_t target = now / m_tick_len;
+
+    for (;;) {
+        Timer* head = slot(0, m_current);
+        if (head->m_next != head) {
+            Timer* timer = head->m_next;
+            timer->cancel();
+            return timer;
+        }
+
+        if (m_current >= target)
+            return nullptr;
+
+        m_current++;
+
+        /* Entering a new block of a higher level - pull its timers down,
+         * highest level first so they can cascade all the way */
+        int top = 0;
+        while (top < kLevels - 1 && (m_current & ((static_cast<uint64_t>(1) << ((top + 1) * kSlotBits)) - 1)) == 0)
+            top++;
+        for (int level = top; level > 0; --level)
+            cascade(level);
+    }
+}
+
+uint64_t TimerWheel::next_expiry()
+{
+    /* Level 0 holds everything due within kSlots ticks, one tick per slot */
+    for (uint64_t i = 0; i < kSlots; ++i) {
+        Timer* head = slot(0, m_current + i);
+        if (head->m_next != head)
+            return (m_current + i) * m_tick_len;
+    }
+
+    /* Higher levels - the earliest occupied block is when its timers come down */
+    uint64_t earliest = UINT64_MAX;
+    for (int level = 1; level < kLevels; ++level) {
+        int shift = level * kSlotBits;
+        for (uint64_t i = 1; i <= kSlots; ++i) {
+            uint64_t tick = ((m_current >> shift) + i) << shift;
+            Timer* head = slot(level, tick);
+            if (head->m_next != head) {
+                if (tick < earliest)
+                    earliest = tick;
+                break;
+            }
+        }
+    }
+
+    return earliest == UINT64_MAX ? UINT64_MAX : earliest * m_tick_len;
+}
+
+} // namespace chatter
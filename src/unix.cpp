@@ -1,11 +1,17 @@
 #include "chatter/platform.h"
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <cstring>
 
+#include "chatter/config.h"
+
 namespace chatter {
 namespace platform {
 
@@ -38,6 +44,10 @@ bool SocketSetOption(Socket socket, SocketOption option, int value)
             result = setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, (char*)&value, sizeof(int));
             break;
 
+        case SocketOption::REUSEPORT:
+            result = setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, (char*)&value, sizeof(int));
+            break;
+
         case SocketOption::RCVBUF:
             result = setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (char*)&value, sizeof(int));
             break;
@@ -58,6 +68,15 @@ bool SocketSetOption(Socket socket, SocketOption option, int value)
             result = setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeVal, sizeof(struct timeval));
             break;
 
+        case SocketOption::DONT_FRAGMENT:
+            {
+                /* PROBE rather than DO - DF is set, but the kernel's cached path
+                 * MTU doesn't stop us sending probes larger than it */
+                int mode = value ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+                result = setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, (char*)&mode, sizeof(int));
+            }
+            break;
+
 #if 0
         case SocketOption::NODELAY:
             result = setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&value, sizeof(int));
@@ -82,6 +101,28 @@ bool SocketBind(Socket socket, const HostAddress& address)
     return rc == 0 ? true : false;
 }
 
+bool SocketGetAddress(Socket socket, HostAddress* address)
+{
+    struct sockaddr_in sin = {0};
+    socklen_t sin_len = sizeof(sin);
+
+    if (getsockname(socket, (struct sockaddr*)&sin, &sin_len) != 0)
+        return false;
+
+    *address = HostAddress(sin.sin_addr.s_addr, NetToHost16(sin.sin_port));
+    return true;
+}
+
+bool SocketWaitReadable(Socket socket, int timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd = socket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, timeout_ms) > 0;
+}
+
 ssize_t SocketSendTo(Socket socket, const void *buf, size_t buf_len, const HostAddress& address)
 {
     struct sockaddr_in dest = {0};
@@ -100,6 +141,190 @@ ssize_t SocketRecvFrom(Socket socket, void *buf, size_t buf_len, HostAddress* ad
     return ret;
 }
 
+int SocketRecvBatch(Socket socket, Datagram* datagrams, std::size_t count)
+{
+    struct mmsghdr msgs[kSocketBatchSize];
+    struct iovec iovs[kSocketBatchSize];
+    struct sockaddr_in srcs[kSocketBatchSize];
+
+    if (count > kSocketBatchSize)
+        count = kSocketBatchSize;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        iovs[i].iov_base = datagrams[i].buf;
+        iovs[i].iov_len = datagrams[i].buf_len;
+        std::memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &srcs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(srcs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* Block for the first datagram, then take whatever else is already queued */
+    int ret = recvmmsg((int)socket, msgs, count, MSG_WAITFORONE, nullptr);
+
+    for (int i = 0; i < ret; ++i) {
+        datagrams[i].msg_len = msgs[i].msg_len;
+        datagrams[i].address = HostAddress(srcs[i].sin_addr.s_addr, NetToHost16(srcs[i].sin_port));
+    }
+
+    return ret;
+}
+
+int SocketSendBatch(Socket socket, const Datagram* datagrams, std::size_t count)
+{
+    struct mmsghdr msgs[kSocketBatchSize];
+    struct iovec iovs[kSocketBatchSize * kMaxDatagramSegments];
+    struct sockaddr_in dests[kSocketBatchSize];
+    std::size_t iov_count = 0;
+
+    if (count > kSocketBatchSize)
+        count = kSocketBatchSize;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        const Datagram& d = datagrams[i];
+
+        std::memset(&dests[i], 0, sizeof(dests[i]));
+        dests[i].sin_family = AF_INET;
+        dests[i].sin_port = HostToNet16(d.address.port());
+        dests[i].sin_addr.s_addr = d.address.address();
+
+        std::memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &dests[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(dests[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[iov_count];
+
+        if (d.segment_count) {
+            std::size_t segments = d.segment_count < kMaxDatagramSegments ? d.segment_count : kMaxDatagramSegments;
+            for (std::size_t s = 0; s < segments; ++s) {
+                iovs[iov_count].iov_base = const_cast<void*>(d.segments[s].buf);
+                iovs[iov_count].iov_len = d.segments[s].len;
+                iov_count++;
+            }
+            msgs[i].msg_hdr.msg_iovlen = segments;
+        }
+        else {
+            iovs[iov_count].iov_base = d.buf;
+            iovs[iov_count].iov_len = d.msg_len;
+            iov_count++;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    /* Returns the number of datagrams sent, which may be fewer than count */
+    return sendmmsg((int)socket, msgs, count, 0);
+}
+
+WakeEvent WakeEventCreate()
+{
+    return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+void WakeEventDestroy(WakeEvent event)
+{
+    if (event != CH_WAKE_EVENT_NULL)
+        close(event);
+}
+
+void WakeEventSignal(WakeEvent event)
+{
+    uint64_t one = 1;
+    ssize_t ret = write(event, &one, sizeof(one));
+    (void)ret; /* Only fails if the counter would overflow - already signalled */
+}
+
+bool WakeEventWait(WakeEvent event, int64_t timeout_us)
+{
+    struct pollfd pfd;
+    pfd.fd = event;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    /* ppoll rather than poll for sub-millisecond timeouts */
+    struct timespec timeout;
+    timeout.tv_sec = timeout_us / 1000000;
+    timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+
+    if (ppoll(&pfd, 1, timeout_us < 0 ? nullptr : &timeout, nullptr) <= 0)
+        return false;
+
+    /* Consume the signal */
+    uint64_t count;
+    return read(event, &count, sizeof(count)) == sizeof(count);
+}
+
+DeadlineTimer DeadlineTimerCreate()
+{
+    return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+void DeadlineTimerDestroy(DeadlineTimer timer)
+{
+    if (timer != CH_DEADLINE_TIMER_NULL)
+        close(timer);
+}
+
+void DeadlineTimerArm(DeadlineTimer timer, uint64_t delay_us)
+{
+    struct itimerspec spec = {};
+
+    /* A zero it_value would disarm - expire as soon as possible instead */
+    if (!delay_us)
+        spec.it_value.tv_nsec = 1;
+    else {
+        spec.it_value.tv_sec = delay_us / 1000000;
+        spec.it_value.tv_nsec = (delay_us % 1000000) * 1000;
+    }
+
+    timerfd_settime(timer, 0, &spec, nullptr);
+}
+
+void DeadlineTimerDisarm(DeadlineTimer timer)
+{
+    struct itimerspec spec = {};
+    timerfd_settime(timer, 0, &spec, nullptr);
+}
+
+void DeadlineTimerConsume(DeadlineTimer timer)
+{
+    uint64_t expirations;
+    ssize_t ret = read(timer, &expirations, sizeof(expirations));
+    (void)ret; /* EAGAIN if it hadn't expired */
+}
+
+Poller PollerCreate()
+{
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+void PollerDestroy(Poller poller)
+{
+    if (poller != CH_POLLER_NULL)
+        close(poller);
+}
+
+bool PollerAdd(Poller poller, int fd)
+{
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(poller, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+int PollerWait(Poller poller, int* ready_fds, int max_ready, int timeout_ms)
+{
+    struct epoll_event events[8];
+
+    if (max_ready > 8)
+        max_ready = 8;
+
+    int count = epoll_wait(poller, events, max_ready, timeout_ms);
+    for (int i = 0; i < count; ++i)
+        ready_fds[i] = events[i].data.fd;
+
+    return count;
+}
+
 bool HostAddressStringToNet32(const std::string address, uint32_t* out)
 {
     if (!out)